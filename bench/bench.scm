@@ -0,0 +1,236 @@
+;;   Copyright (C) 2026 Free Software Foundation, Inc.
+;;
+;;   This file is part of GNU mcron.
+;;
+;;   GNU mcron is free software: you can redistribute it and/or modify it under
+;;   the terms of the GNU General Public License as published by the Free
+;;   Software Foundation, either version 3 of the License, or (at your option)
+;;   any later version.
+;;
+;;   GNU mcron is distributed in the hope that it will be useful, but WITHOUT
+;;   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+;;   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+;;   more details.
+;;
+;;   You should have received a copy of the GNU General Public License along
+;;   with GNU mcron.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+;; Time the parts of the scheduler which matter on a large system, against the
+;; spool made by generate.scm. This file is run as a configuration file by the
+;; mcron personality,
+;;
+;;   MCRON_BENCH_DIR=bench.d ./mcron bench/bench.scm
+;;
+;; so that it sees the program's own procedures (and the native ones in the C
+;; wrapper) and drives them just as the daemon does; it never returns to the
+;; program, so no jobs are ever run. `make bench' does all this.
+;;
+;; The clock is frozen at noon on the day before the spring change to summer
+;; time in a time zone with the North American rules, so that the results do
+;; not depend on when or where the benchmarks are run, and the next-time
+;; computations have to cross both changes of the clocks.
+;;
+;; The results are written to standard output as one JSON object per line. Each
+;; benchmark gives its name, the number of operations timed, the total time in
+;; seconds and the time per operation in microseconds; the other lines describe
+;; the run (the size of the spool, and whether the native parser and next-time
+;; computation were available).
+
+
+
+(use-modules (mcron core)
+             (mcron vixie-time)
+             (mcron metrics))
+
+(define bench-directory (or (getenv "MCRON_BENCH_DIR") "bench.d"))
+
+(define (bench-file name) (string-append bench-directory "/" name))
+
+
+
+;; Freeze the clock.
+
+(setenv "TZ" "EST5EDT,M3.2.0,M11.1.0")
+(tzset)
+
+(define (local-time string)
+  (let ((time (car (strptime "%Y-%m-%d %H:%M" string))))
+    (set-tm:sec time 0)
+    (set-tm:isdst time -1)
+    (car (mktime time))))
+
+(define frozen-time (local-time "2026-03-07 12:00"))
+(define autumn-time (local-time "2026-10-31 12:00"))
+
+(module-set! the-root-module 'current-time (lambda () frozen-time))
+(set-configuration-time frozen-time)
+
+
+
+;; Reporting.
+
+(define (json-pair name value)
+  (string-append "\"" name "\": "
+                 (cond ((string? value) (string-append "\"" value "\""))
+                       ((boolean? value) (if value "true" "false"))
+                       ((and (exact? value) (integer? value))
+                        (number->string value))
+                       (else (number->string (exact->inexact value))))))
+
+(define (report . pairs)
+  (display "{")
+  (display (string-join (let loop ((pairs pairs))
+                          (if (null? pairs)
+                              '()
+                              (cons (json-pair (car pairs) (cadr pairs))
+                                    (loop (cddr pairs)))))
+                        ", "))
+  (display "}")
+  (newline)
+  (force-output))
+
+(define (benchmark name operations thunk)
+  (gc)
+  (let ((start (metrics-clock)))
+    (thunk)
+    (let ((seconds (- (metrics-clock) start)))
+      (report "benchmark" name
+              "operations" operations
+              "seconds" seconds
+              "per_op_us" (if (> operations 0)
+                              (/ (* seconds 1000000) operations)
+                              0)))))
+
+(define (repeat count thunk)
+  (do ((count count (- count 1)))
+      ((<= count 0))
+    (thunk)))
+
+
+
+;; The synthetic spool. Each crontab belongs to a made-up user with a UID of its
+;; own, so that the core keeps their jobs apart just as it would real users'.
+
+(define specs
+  (with-input-from-file (bench-file "specs")
+    (lambda ()
+      (let loop ((specs '()))
+        (let ((line (read-line)))
+          (if (eof-object? line)
+              (reverse! specs)
+              (loop (cons line specs))))))))
+
+(define users (make-hash-table))
+
+(let ((directory (opendir (bench-file "spool")))
+      (uid 200000))
+  (do ((file-name (readdir directory) (readdir directory)))
+      ((eof-object? file-name) (closedir directory))
+    (if (not (string-prefix? "." file-name))
+        (begin
+          (hash-set! users file-name
+                     (vector file-name "x" uid uid file-name "/" "/bin/sh"))
+          (set! uid (+ uid 1))))))
+
+(define user-names (sort (hash-map->list (lambda (name user) name) users)
+                         string<?))
+
+(set! spool-directory (bench-file "spool"))
+(set! crontab-cache-file (bench-file "cache"))
+(set! passwd-table (lambda () users))
+(set! spool-user (lambda (name) (hash-ref users name)))
+
+(define (remove-all-jobs)
+  (hash-for-each (lambda (name user) (remove-user-jobs user)) users))
+
+(report "users" (length user-names)
+        "specs" (length specs)
+        "native_parser" (if (module-variable the-root-module
+                                             'c-parse-crontab-files)
+                            #t
+                            #f)
+        "native_next_time" (if (module-variable the-root-module
+                                                 'c-compile-vixie-time)
+                               #t
+                               #f)
+        "frozen_time" frozen-time)
+
+
+
+;; Parsing time specifications, and computing next times with them across both
+;; changes of the clocks.
+
+(let ((rounds (max 1 (quotient 20000 (max 1 (length specs))))))
+  (benchmark "parse-vixie-time"
+             (* rounds (length specs))
+             (lambda () (repeat rounds
+                                (lambda () (for-each parse-vixie-time specs))))))
+
+(let ((next-time-functions (map parse-vixie-time specs))
+      (steps 50))
+  (for-each (lambda (name base-time)
+              (benchmark name
+                         (* steps (length next-time-functions))
+                         (lambda ()
+                           (for-each (lambda (next-time)
+                                       (do ((step 0 (+ step 1))
+                                            (time base-time (next-time time)))
+                                           ((>= step steps))))
+                                     next-time-functions))))
+            '("next-time-dst-spring" "next-time-dst-autumn")
+            (list frozen-time autumn-time)))
+
+
+
+;; Reading the whole spool at start-up, first with no cache and then with the
+;; cache made by the first run. The size of the heap once all the jobs are in
+;; shows how much each job costs to keep.
+
+(false-if-exception (delete-file crontab-cache-file))
+
+(benchmark "startup-cold" (length user-names) process-files-in-system-directory)
+
+(gc)
+
+(report "jobs" (length (job-status))
+        "schedules" (@@ (mcron core) schedule-heap-size)
+        "heap_bytes" (assq-ref (gc-stats) 'heap-size))
+
+(remove-all-jobs)
+
+(benchmark "startup-warm" (length user-names) process-files-in-system-directory)
+
+
+
+;; Looking ahead.
+
+(let ((find-next-schedules (@@ (mcron core) find-next-schedules)))
+  (benchmark "find-next-schedules" 10000
+             (lambda () (repeat 10000 find-next-schedules))))
+
+(benchmark "get-schedule-100" 10
+           (lambda () (repeat 10 (lambda () (get-schedule 100)))))
+
+(benchmark "job-forecast-2-hours" 10
+           (lambda ()
+             (repeat 10 (lambda ()
+                          (job-forecast #f
+                                        #:from (+ frozen-time 7200)
+                                        #:until (+ frozen-time 14400))))))
+
+
+
+;; Re-reading a tenth of the crontabs, as the daemon does when the crontab
+;; program or the crontab watch tells it they have changed: first one at a time,
+;; as separate requests would, and then all in one batch.
+
+(let ((names (list-head user-names (max 1 (quotient (length user-names) 10)))))
+  (benchmark "reload-one-at-a-time" (length names)
+             (lambda ()
+               (for-each (lambda (name) (reload-crontabs (list name))) names)))
+  (benchmark "reload-batched" (length names)
+             (lambda () (reload-crontabs names))))
+
+(exit 0)
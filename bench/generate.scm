@@ -0,0 +1,147 @@
+;;   Copyright (C) 2026 Free Software Foundation, Inc.
+;;
+;;   This file is part of GNU mcron.
+;;
+;;   GNU mcron is free software: you can redistribute it and/or modify it under
+;;   the terms of the GNU General Public License as published by the Free
+;;   Software Foundation, either version 3 of the License, or (at your option)
+;;   any later version.
+;;
+;;   GNU mcron is distributed in the hope that it will be useful, but WITHOUT
+;;   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+;;   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+;;   more details.
+;;
+;;   You should have received a copy of the GNU General Public License along
+;;   with GNU mcron.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+;; Make a synthetic crontab spool for the benchmarks (see bench.scm). This file
+;; is run as a configuration file by the mcron personality,
+;;
+;;   MCRON_BENCH_DIR=bench.d MCRON_BENCH_USERS=1000 MCRON_BENCH_LINES=20 \
+;;       ./mcron bench/generate.scm
+;;
+;; and writes MCRON_BENCH_USERS crontabs, named user0000, user0001 and so on,
+;; of MCRON_BENCH_LINES job lines each, into the spool directory under
+;; MCRON_BENCH_DIR. The jobs are drawn at random, but always the same ones for
+;; the same MCRON_BENCH_SEED, from a mixture of the kinds of time specification
+;; found on real systems: steps, fixed times, ranges and lists, days of the
+;; month combined with days of the week, month and day names, and the
+;; schedules of the @hourly, @daily, @weekly, @monthly and @yearly macros
+;; (written out in full, as mcron does not understand the macros themselves).
+;; A sprinkling of comments, blank lines, environment settings and continued
+;; lines is added as well.
+;;
+;; The distinct time specifications are also written, one per line, to the
+;; file specs in MCRON_BENCH_DIR.
+
+
+
+(define (bench-setting name default)
+  (let ((value (getenv name)))
+    (if value (string->number value) default)))
+
+(define bench-directory (or (getenv "MCRON_BENCH_DIR") "bench.d"))
+(define bench-users (bench-setting "MCRON_BENCH_USERS" 1000))
+(define bench-lines (bench-setting "MCRON_BENCH_LINES" 20))
+
+(define state (seed->random-state (bench-setting "MCRON_BENCH_SEED" 1)))
+
+(define (pick list) (list-ref list (random (length list) state)))
+(define (chance percent) (< (random 100 state) percent))
+(define (number-below n) (number->string (random n state)))
+
+
+
+;; Each kind of time specification, with the weight (out of 100) with which it
+;; is chosen.
+
+(define spec-kinds
+  `((25 . ,(lambda ()
+             (string-append "*/" (number->string (pick '(2 5 10 15 20 30)))
+                            " * * * *")))
+    (20 . ,(lambda ()
+             (string-append (number-below 60) " " (number-below 24)
+                            " * * *")))
+    (12 . ,(lambda ()
+             (let ((start (random 12 state)))
+               (string-append (number-below 60) " "
+                              (number->string start) "-"
+                              (number->string (+ start 1 (random 11 state)))
+                              " * * " (pick '("1-5" "mon-fri" "0,6"))))))
+    (10 . ,(lambda ()
+             (string-append (number-below 30) "," (number->string
+                                                   (+ 30 (random 30 state)))
+                            " " (number-below 24) "," (number-below 24)
+                            " * * *")))
+    (8 . ,(lambda ()
+            (string-append (number-below 60) " " (number-below 24) " "
+                           (number->string (+ 1 (random 28 state)))
+                           " * " (pick '("1" "5" "sun" "sat")))))
+    (5 . ,(lambda ()
+            (string-append (number-below 60) " " (number-below 24) " "
+                           (pick '("1" "15" "1,15" "28-31")) " "
+                           (pick '("jan,jul" "*/3" "mar-oct" "dec")) " *")))
+    (5 . ,(lambda ()
+            (string-append "0-30/5 " (pick '("9-17" "8-18/2" "*/4"))
+                           " * * " (pick '("mon-fri" "*" "1-5")))))
+    (15 . ,(lambda ()
+             (pick '("0 * * * *"        ;; @hourly
+                     "0 0 * * *"        ;; @daily, @midnight
+                     "0 0 * * 0"        ;; @weekly
+                     "0 0 1 * *"        ;; @monthly
+                     "0 0 1 1 *"))))))  ;; @yearly
+
+(define (random-spec)
+  (let loop ((kinds spec-kinds) (roll (random 100 state)))
+    (if (or (null? (cdr kinds)) (< roll (caar kinds)))
+        ((cdar kinds))
+        (loop (cdr kinds) (- roll (caar kinds))))))
+
+
+
+(define specs (make-hash-table))
+
+(define (write-crontab file-name user-number)
+  (with-output-to-file file-name
+    (lambda ()
+      (display "# Synthetic crontab for the mcron benchmarks.\n")
+      (if (chance 30)
+          (display (string-append "MAILTO=user"
+                                  (number->string user-number)
+                                  "@example.com\n")))
+      (do ((line 0 (+ line 1)))
+          ((>= line bench-lines))
+        (let ((spec (random-spec)))
+          (hash-set! specs spec #t)
+          (cond ((chance 5) (display "\n# Housekeeping.\n"))
+                ((chance 3) (display "PATH=/usr/local/bin:/usr/bin:/bin\n")))
+          (display spec)
+          (display " ")
+          (if (chance 2)
+              (display "echo continued \\\n    line")
+              (display (string-append "echo job "
+                                      (number->string user-number) "."
+                                      (number->string line)
+                                      " > /dev/null")))
+          (newline))))))
+
+
+(let ((spool (string-append bench-directory "/spool")))
+  (if (not (access? bench-directory F_OK)) (mkdir bench-directory))
+  (if (not (access? spool F_OK)) (mkdir spool))
+  (do ((user 0 (+ user 1)))
+      ((>= user bench-users))
+    (let ((number (number->string user)))
+      (write-crontab (string-append spool "/user"
+                                    (string-pad number
+                                                (max 4 (string-length number))
+                                                #\0))
+                     user)))
+  (with-output-to-file (string-append bench-directory "/specs")
+    (lambda ()
+      (hash-for-each (lambda (spec true) (display spec) (newline)) specs))))
+
+(exit 0)
@@ -32,9 +32,14 @@
 
 (define-module (mcron environment)
   #:export (modify-environment
+            environment-strings
             clear-environment-mods
             append-environment-mods
-            get-current-environment-mods-copy))
+            get-current-environment-mods-copy
+            get-current-environment-mod
+            restore-environment-mods))
+
+(use-modules (srfi srfi-1))   ;; For fold, remove and filter-map.
             
             
 
@@ -69,18 +74,61 @@
 
 
 
+;; Return the complete UNIX environment a job would see after
+;; modify-environment, as a list of "NAME=value" strings. This lets the core
+;; prepare the environment of a shell command job once, when it is configured,
+;; rather than setting the variables one by one every time the job runs.
+
+(define (environment-strings env-alist passwd-entry)
+  (map (lambda (variable) (string-append (car variable) "=" (cdr variable)))
+       (reverse
+        (fold (lambda (variable environment)
+                (let ((environment (remove (lambda (old)
+                                             (string=? (car old)
+                                                       (car variable)))
+                                           environment)))
+                  (if (cdr variable)
+                      (cons variable environment)
+                      environment)))
+              (filter-map (lambda (string)
+                            (and=> (string-index string #\=)
+                                   (lambda (index)
+                                     (cons (substring string 0 index)
+                                           (substring string (+ index 1))))))
+                          (reverse (environ)))
+              (impose-default-environment env-alist passwd-entry)))))
+
+
+
+
 ;; As we parse configuration files, we build up an alist of environment
-;; variables here.
+;; variables here. The settings are kept latest first, so that adding one does
+;; not mean copying all the others.
 
 (define current-environment-mods '())
 
 
 
 ;; Each time a job is added to the system, we take a snapshot of the current
-;; set of environment modifiers.
+;; set of environment modifiers, in the order in which they were made. All the
+;; jobs which are added while the settings stay the same get the same snapshot,
+;; which is made the first time it is asked for; it must not be modified.
+
+(define environment-snapshot #f)
 
 (define (get-current-environment-mods-copy)
-  (list-copy current-environment-mods))
+  (or environment-snapshot
+      (begin
+        (set! environment-snapshot (reverse current-environment-mods))
+        environment-snapshot)))
+
+
+
+;; Return the value most recently given to the named variable in the current
+;; configuration file, or #f if it has not been set.
+
+(define (get-current-environment-mod name)
+  (and=> (assoc name current-environment-mods) cdr))
 
 
 
@@ -89,7 +137,19 @@
 ;; environment).
 
 (define (clear-environment-mods)
-  (set! current-environment-mods '()))
+  (set! current-environment-mods '())
+  (set! environment-snapshot '()))
+
+
+
+;; Put back a set of environment modifiers, as previously taken with
+;; get-current-environment-mods-copy.
+
+(define (restore-environment-mods mods)
+  (if (not (eq? mods environment-snapshot))
+      (begin
+        (set! current-environment-mods (reverse mods))
+        (set! environment-snapshot mods))))
 
 
 
@@ -100,6 +160,7 @@
 ;; (yuk).
 
 (define (append-environment-mods name value)
-  (set! current-environment-mods (append current-environment-mods
-                                         (list (cons name value))))
+  (set! current-environment-mods (cons (cons name value)
+                                       current-environment-mods))
+  (set! environment-snapshot #f)
   #t)
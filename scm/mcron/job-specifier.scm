@@ -212,6 +212,67 @@
 
 
 
+;; Vixie-style time specifications are the only ones we can recognize as being
+;; the same as one another, so that the jobs which share one can be run off a
+;; single schedule in the core. The key is the text of the specification with
+;; the fields separated by single spaces, in lower case since month and day
+;; names may be given in any case, followed by the time zone if the job has one
+;; of its own.
+
+(define (vixie-time-key time-string timezone)
+  (let ((key (string-join (string-tokenize (string-downcase time-string)) " ")))
+    (if timezone (string-append key " " timezone) key)))
+
+
+
+;; Add the daylight saving time adjustment to a next-time function, and make
+;; the function maintain the current-action-time. The procedures made by
+;; parse-vixie-time already allow for the changes of the clocks, and only need
+;; the latter. If the job has a time zone of its own, the function is run with
+;; TZ set to it.
+
+(define* (normalize-time-proc time-proc #:optional (timezone #f))
+  (cond
+   ((procedure-property time-proc 'dst-adjusted)
+    (lambda (current-time)
+      (set! current-action-time current-time)
+      (time-proc current-time)))
+   (timezone
+    (let ((time-proc (normalize-time-proc time-proc)))
+      (lambda (current-time)
+        (call-with-timezone timezone
+                            (lambda () (time-proc current-time))))))
+   (else
+    (lambda (current-time)
+      (set! current-action-time current-time)  ;; ?? !!!!  Code
+
+      ;; Contributed by Sergey Poznyakoff to allow for daylight savings
+      ;; time changes.
+      (let* ((next (time-proc current-time))
+             (gmtoff (tm:gmtoff (localtime next)))
+             (d (+ next (- gmtoff
+                           (tm:gmtoff (localtime current-time))))))
+        (if (eqv? (tm:gmtoff (localtime d)) gmtoff)
+            d
+            next))))))
+
+
+
+;; The normalized next-time functions of Vixie-style specifications are kept
+;; here, keyed as above, so that each distinct specification is only parsed
+;; once. The core holds on to the functions for as long as any job uses them.
+
+(define vixie-time-procs (make-weak-value-hash-table))
+
+(define (vixie-time-proc key time-string timezone)
+  (or (hash-ref vixie-time-procs key)
+      (let ((time-proc (normalize-time-proc (parse-vixie-time time-string
+                                                              timezone))))
+        (hash-set! vixie-time-procs key time-proc)
+        time-proc)))
+
+
+
 ;; The job function, available to configuration files for adding a job rule to
 ;; the system.
 ;;
@@ -224,49 +285,130 @@
 ;; current-action-time global variable). A similar normalization is applied to
 ;; the action.
 ;;
+;; Jobs with the same Vixie-style time specification share a single
+;; next-time-function, and are given the same schedule key in the core so that
+;; their next times are computed only once.
+;;
 ;; Here we also compute the first time that the job is supposed to run, by
 ;; finding the next legitimate time from the current configuration time (set
 ;; right at the top of this program).
-
-(define (job time-proc action . displayable)
-  (let ((action (cond ((procedure? action) action)
-                      ((list? action) (lambda () (primitive-eval action)))
-                      ((string? action) (lambda () (system action)))
-                      (else 
-           (throw 'mcron-error 
-                  2
-                  "job: invalid second argument (action; should be lambda"
-                  " function, string or list)"))))
-
-        (time-proc
-         (cond ((procedure? time-proc) time-proc)
-               ((string? time-proc)    (parse-vixie-time time-proc))
-               ((list? time-proc)      (lambda (current-time)
-                                         (primitive-eval time-proc)))
-               (else
-          (throw 'mcron-error 
-                 3       
-                 "job: invalid first argument (next-time-function; should ")
-                 "be function, string or list)")))
-        (displayable
-         (cond ((not (null? displayable)) (car displayable))
-               ((procedure? action) "Lambda function")
-               ((string? action) action)
-               ((list? action) (with-output-to-string
-                                 (lambda () (display action)))))))
-    (add-job (lambda (current-time)
-               (set! current-action-time current-time)  ;; ?? !!!!  Code
-               
-               ;; Contributed by Sergey Poznyakoff to allow for daylight savings
-               ;; time changes.
-               (let* ((next (time-proc current-time))
-                      (gmtoff (tm:gmtoff (localtime next)))
-                      (d (+ next (- gmtoff
-                                    (tm:gmtoff (localtime current-time))))))
-                 (if (eqv? (tm:gmtoff (localtime d)) gmtoff)
-                     d
-                     next)))
-             action
-             displayable
-             configuration-time
-             configuration-user)))
+;;
+;; After the optional displayable, the keywords #:overlap (one of the symbols
+;; run, skip or queue) and #:spread (a number of seconds) may be given to control
+;; how the job is dispatched by the core; if they are not, they are taken from
+;; the MCRON_OVERLAP and MCRON_SPREAD environment settings in force, so that
+;; Vixie-style crontabs can use them too. Likewise #:timezone, or CRON_TZ, gives
+;; the time zone in which the job's times are local times (see the vixie-time
+;; module), and #:catch-up (none, once or all) and #:catch-up-limit, or
+;; MCRON_CATCH_UP and MCRON_CATCH_UP_LIMIT, say which of the runs missed while
+;; the daemon was down are to be made up (see the core module).
+
+(define (job-option options keyword setting)
+  (cond ((memq keyword options)
+         => (lambda (tail)
+              (if (null? (cdr tail))
+                  (throw 'mcron-error 17
+                         "job: no value given for #:"
+                         (symbol->string (keyword->symbol keyword)))
+                  (cadr tail))))
+        (else (get-current-environment-mod setting))))
+
+(define (job-overlap-policy value)
+  (let ((policy (if (string? value)
+                    (string->symbol (string-downcase value))
+                    (or value 'run))))
+    (if (memq policy '(run skip queue))
+        policy
+        (throw 'mcron-error 17
+               "job: invalid overlap policy (should be run, skip or queue)"))))
+
+(define (job-spread value)
+  (let ((spread (if (string? value) (string->number value) (or value 0))))
+    (if (and (integer? spread) (exact? spread) (>= spread 0))
+        spread
+        (throw 'mcron-error 17
+               "job: invalid spread (should be a number of seconds)"))))
+
+(define (job-catch-up-policy value)
+  (let ((policy (if (string? value)
+                    (string->symbol (string-downcase value))
+                    (or value 'none))))
+    (if (memq policy '(none once all))
+        policy
+        (throw 'mcron-error 17
+               "job: invalid catch-up policy (should be none, once or all)"))))
+
+(define (job-catch-up-limit value)
+  (let ((limit (if (string? value) (string->number value) (or value 10))))
+    (if (and (integer? limit) (exact? limit) (> limit 0))
+        limit
+        (throw 'mcron-error 17
+               "job: invalid catch-up limit (should be a number of runs)"))))
+
+(define (job-timezone value)
+  (cond ((or (not value) (equal? value "")) #f)
+        ((valid-timezone? value) value)
+        (else (throw 'mcron-error 17
+                     "job: unknown time zone " value))))
+
+(define (job time-proc action . options)
+  (let* ((displayable  (and (pair? options)
+                            (not (keyword? (car options)))
+                            (list (car options))))
+         (options      (if displayable (cdr options) options))
+         (displayable  (or displayable '()))
+         (timezone     (job-timezone
+                        (job-option options #:timezone "CRON_TZ")))
+         (schedule-key (and (string? time-proc)
+                            (vixie-time-key time-proc timezone)))
+         (command      (and (string? action) action))
+         (overlap      (job-overlap-policy
+                        (job-option options #:overlap "MCRON_OVERLAP")))
+         (spread       (job-spread
+                        (job-option options #:spread "MCRON_SPREAD")))
+         (catch-up     (job-catch-up-policy
+                        (job-option options #:catch-up "MCRON_CATCH_UP")))
+         (catch-up-limit (job-catch-up-limit
+                          (job-option options #:catch-up-limit
+                                      "MCRON_CATCH_UP_LIMIT"))))
+    (let ((action (cond ((procedure? action) action)
+                        ((list? action) (lambda () (primitive-eval action)))
+                        ((string? action) (lambda () (system action)))
+                        (else 
+             (throw 'mcron-error 
+                    2
+                    "job: invalid second argument (action; should be lambda"
+                    " function, string or list)"))))
+
+          (time-proc
+           (cond ((procedure? time-proc) (normalize-time-proc time-proc
+                                                              timezone))
+                 ((string? time-proc)    (vixie-time-proc schedule-key
+                                                          time-proc
+                                                          timezone))
+                 ((list? time-proc)      (normalize-time-proc
+                                          (lambda (current-time)
+                                            (primitive-eval time-proc))
+                                          timezone))
+                 (else
+            (throw 'mcron-error 
+                   3       
+                   "job: invalid first argument (next-time-function; should ")
+                   "be function, string or list)")))
+          (displayable
+           (cond ((not (null? displayable)) (car displayable))
+                 ((procedure? action) "Lambda function")
+                 ((string? action) action)
+                 ((list? action) (with-output-to-string
+                                   (lambda () (display action)))))))
+      (add-job time-proc
+               action
+               displayable
+               configuration-time
+               configuration-user
+               #:schedule-key schedule-key
+               #:command command
+               #:overlap overlap
+               #:spread spread
+               #:catch-up catch-up
+               #:catch-up-limit catch-up-limit))))
@@ -110,8 +110,12 @@
                                        (predicate
                                         ,(lambda (value)
                                            (string->number value))))
+                             (window   (single-char #\w) (value #t))
                              (daemon   (single-char #\d) (value #f))
                              (noetc    (single-char #\n) (value #f))
+                             (shard-dir     (value #t))
+                             (shard-members (value #t))
+                             (shard-name    (value #t))
                              (stdin    (single-char #\i) (value #t)
                                        (predicate
                                         ,(lambda (value)
@@ -156,6 +160,8 @@ deprecated ~/.cron) with .guile or .vixie extensions.\n
   -v, --version             Display version\n
   -h, --help                Display this help message\n
   -sN, --schedule[=]N       Display the next N jobs that will be run by mcron\n
+  -w, --window=FROM,UNTIL   Only display jobs which run in the given window of\n
+                              time (with --schedule)\n
   -d, --daemon              Immediately detach the program from the terminal\n
                               and run as a daemon process\n
   -i, --stdin=(guile|vixie) Format of data passed as standard input or\n
@@ -169,8 +175,14 @@ reading all the information in the users' crontabs and in /etc/crontab.\n
   -v, --version             Display version\n
   -h, --help                Display this help message\n
   -sN, --schedule[=]N       Display the next N jobs that will be run by cron\n
+  -w, --window=FROM,UNTIL   Only display jobs which run in the given window of\n
+                              time (with --schedule)\n
   -n, --noetc               Do not check /etc/crontab for updates (HIGHLY\n
-                              RECOMMENDED).")
+                              RECOMMENDED).\n
+  --shard-dir=DIR           Share the spool with the other members of a shard\n
+                              group, whose leases are kept in DIR\n
+  --shard-members=A,B,...   The names of all the members of the group\n
+  --shard-name=NAME         The name of this member (default the host name)")
   
   ((crontab)
            (string-append " [-u user] file\n"
@@ -189,15 +201,187 @@ Report bugs to " config-package-bugreport ".\n
 
 
 
+;; If the user wants to see the schedule of jobs, work out exactly what has been
+;; asked for. The --window option gives the times FROM and UNTIL, either of
+;; which may be left empty, separated by a comma. Each time may be a number of
+;; seconds since the epoch, a local date and time as YYYY-MM-DD HH:MM, or just
+;; HH:MM for the next time the clock reads that after the current time (for
+;; FROM) or after FROM (for UNTIL). The request is then a list of the count of
+;; time points to show and the two times, any of which may be #f, or just #f if
+;; no schedule is wanted. If neither a count nor an end time is given we assume
+;; a count of 8, and a count is always some positive integer.
+
+(define (parse-schedule-time string base)
+  (catch #t
+         (lambda ()
+           (cond ((string->number string)
+                  => (lambda (time) (if (exact? time) time (throw 'bad-time))))
+                 ((string-index string #\-)
+                  (let ((parsed (strptime "%Y-%m-%d %H:%M" string)))
+                    (if (not (eqv? (cdr parsed) (string-length string)))
+                        (throw 'bad-time))
+                    (set-tm:sec (car parsed) 0)
+                    (set-tm:isdst (car parsed) -1)
+                    (car (mktime (car parsed)))))
+                 (else
+                  (let ((parsed (strptime "%H:%M" string))
+                        (tm (localtime base)))
+                    (if (not (eqv? (cdr parsed) (string-length string)))
+                        (throw 'bad-time))
+                    (set-tm:hour tm (tm:hour (car parsed)))
+                    (set-tm:min tm (tm:min (car parsed)))
+                    (set-tm:sec tm 0)
+                    (set-tm:isdst tm -1)
+                    (let ((time (car (mktime tm))))
+                      (if (> time base)
+                          time
+                          (begin
+                            (set-tm:mday tm (+ (tm:mday tm) 1))
+                            (set-tm:isdst tm -1)
+                            (car (mktime tm)))))))))
+         (lambda (key . args)
+           (mcron-error 1 "Bad time given to --window: " string))))
+
+(define schedule-request
+  (let ((count (option-ref options 'schedule #f))
+        (window (option-ref options 'window #f)))
+    (and (or count window)
+         (let* ((comma (and window (string-index window #\,)))
+                (from-string (if window
+                                 (if comma (substring window 0 comma) window)
+                                 ""))
+                (until-string (if comma (substring window (+ comma 1)) ""))
+                (from (and (not (string-null? from-string))
+                           (parse-schedule-time from-string (current-time))))
+                (until (and (not (string-null? until-string))
+                            (parse-schedule-time until-string
+                                                 (or from (current-time)))))
+                (count (cond (count (max (string->number count) 1))
+                             (until #f)
+                             (else 8))))
+           (list (and count (inexact->exact (floor count))) from until)))))
+
+
+
+;; In sharding mode (--shard-dir), several cron daemons share the spool, each
+;; running the jobs of the users it owns (see the shard module); /etc/crontab is
+;; still read by every member. Each member keeps its own PID file, socket,
+;; cache, journal and metrics file, with its name on the end, so that several
+;; members can run on one host as well as on several.
+
+(use-modules (mcron shard))
+
+(define shard-name
+  (and (eq? command-type 'cron)
+       (option-ref options 'shard-dir #f)
+       (option-ref options 'shard-name (gethostname))))
+
+(if shard-name
+    (catch-mcron-error
+     (set-shard! (option-ref options 'shard-dir #f)
+                 (string-split (option-ref options 'shard-members shard-name)
+                               #\,)
+                 shard-name)))
+
+(define (member-file-name file-name)
+  (if shard-name
+      (string-append file-name "." shard-name)
+      file-name))
+
+(define pid-file (member-file-name config-pid-file))
+
+(define socket-file (member-file-name config-socket-file))
+
+;; The members look at each other's leases this often, in seconds.
+
+(define shard-check-interval 10)
+
+
+
+;; If we are cron and a daemon is already running, it already has all the jobs
+;; loaded, so we ask it for the schedule over its control socket (see the
+;; description of the protocol further down) rather than reading all the
+;; crontabs again ourselves. This also works for users other than root, who are
+;; shown only their own jobs. If the daemon cannot help us for any reason, we
+;; carry on and work out the schedule ourselves.
+
+(define (read-control-reply socket)
+  (let ((status (read-line socket)))
+    (and (string? status)
+         (let loop ((lines '()))
+           (let ((line (read-line socket)))
+             (cond ((not (string? line)) #f)
+                   ((string=? line ".") (cons status (reverse! lines)))
+                   (else (loop (cons (if (string-prefix? "." line)
+                                         (substring line 1)
+                                         line)
+                                     lines)))))))))
+
+;; Each line of the reply is parsed into a pair of the time and the job's
+;; description, or #f if it is not as it should be. The whole reply is parsed
+;; before any of it is shown, so that a bad reply shows nothing (and we work the
+;; schedule out for ourselves instead).
+
+(define (parse-schedule-line line)
+  (let* ((tab (string-index line #\tab))
+         (tab-2 (and tab (string-index line #\tab (+ tab 1))))
+         (time (and tab (string->number (substring line 0 tab)))))
+    (and tab-2
+         time
+         (exact? time)
+         (cons time (substring line (+ tab-2 1))))))
+
+(define (display-daemon-schedule)
+  (catch #t
+         (lambda ()
+           (let ((socket (socket AF_UNIX SOCK_STREAM 0)))
+             (connect socket AF_UNIX socket-file)
+             (display "MCRON 1\nschedule" socket)
+             (for-each (lambda (value)
+                         (display " " socket)
+                         (display (or value "-") socket))
+                       schedule-request)
+             (display "\nquit\n" socket)
+             (force-output socket)
+             (let* ((greeting (read-control-reply socket))
+                    (reply (and greeting (read-control-reply socket))))
+               (close socket)
+               (and reply
+                    (string-prefix? "OK" (car greeting))
+                    (string-prefix? "OK" (car reply))
+                    (let ((entries (map parse-schedule-line (cdr reply))))
+                      (and (not (memq #f entries))
+                           (begin
+                             (for-each
+                              (lambda (entry)
+                                (display (strftime "%c %z\n"
+                                                   (localtime (car entry))))
+                                (display (cdr entry))
+                                (newline)(newline))
+                              entries)
+                             #t)))))))
+         (lambda (key . args) #f)))
+
+(if (and (eq? command-type 'cron)
+         schedule-request
+         (access? pid-file F_OK)
+         (display-daemon-schedule))
+    (quit))
+
+
+
 ;; This is called from the C front-end whenever a terminal signal is
 ;; received. We remove the /var/run/cron.pid file so that crontab and other
 ;; invocations of cron don't get the wrong idea that a daemon is currently
-;; running.
+;; running, send off any job output which is waiting to be mailed, and write
+;; out the last of the run journal.
 
 (define (delete-run-file)
-  (catch #t (lambda () (delete-file config-pid-file)
-                       (delete-file config-socket-file))
+  (catch #t (lambda () (delete-file pid-file)
+                       (delete-file socket-file))
             noop)
+  (catch #t send-job-mail noop)
+  (catch #t sync-job-journal noop)
   (quit))
 
 
@@ -219,20 +403,41 @@ Report bugs to " config-package-bugreport ".\n
           (mcron-error 16
                        "This program must be run by the root user (and should "
                        "have been installed as such)."))
-      (if (access? config-pid-file F_OK)
+      (if (and (not schedule-request) (access? pid-file F_OK))
           (mcron-error 1
 		       "A cron daemon is already running.\n"
 		       "  (If you are sure this is not true, remove the file\n"
 		       "   "
-		       config-pid-file
+		       pid-file
 		       ".)"))
-      (if (not (option-ref options 'schedule #f))
-          (with-output-to-file config-pid-file noop))
+      (if (not schedule-request)
+          (with-output-to-file pid-file noop))
       (setenv "MAILTO" #f)
       (c-set-cron-signals)))
 
 
 
+;; A member of a shard group takes its lease before it reads the spool. If
+;; other members are live, it then gives them time to notice it and let go of
+;; the users it is taking from them, so that no job is run by two members at
+;; once while the users change hands. The daemon takes the lease again once it
+;; has forked (see below); if it cannot, it does not start.
+
+(define (take-lease-or-quit tries)
+  (catch 'mcron-error
+         (lambda () (take-shard-lease! tries))
+         (lambda (key exit-code . msg)
+           (delete-file pid-file)
+           (apply mcron-error exit-code msg))))
+
+(if (and shard-name (not schedule-request))
+    (begin
+      (take-lease-or-quit 1)
+      (if (not (null? (delete shard-name (live-shard-members))))
+          (sleep (+ shard-check-interval 1)))))
+
+
+
 ;; Define the functions available to the configuration files. While we're here,
 ;; we'll get the core loaded as well.
 
@@ -242,6 +447,15 @@ Report bugs to " config-package-bugreport ".\n
 
 
 
+;; The daemon captures the output of the jobs, to be mailed to their owners (or
+;; whoever MAILTO names) and perhaps logged; see the core module. The settings
+;; can be changed in /etc/crontab, which is read later.
+
+(if (and (eq? command-type 'cron) (not schedule-request))
+    (set-job-output!))
+
+
+
 ;; Procedure to slurp the standard input into a string.
 
 (define (stdin->string)
@@ -325,17 +539,86 @@ Report bugs to " config-package-bugreport ".\n
 
 
 
-;; Procedure to check that a user name is in the passwd database (it may happen
-;; that a user is removed after creating a crontab). If the user name is valid,
-;; the full passwd entry for that user is returned to the caller.
+;; The places where the daemon finds the crontabs and keeps its cache, and the
+;; way it finds the user a crontab belongs to. These are the configured ones,
+;; but are kept in variables so that a configuration file loaded by the mcron
+;; personality (the benchmarks in bench/, in particular) can put a spool
+;; somewhere else and populate it with made-up users.
+
+(define spool-directory config-spool-dir)
+
+(define crontab-cache-file (member-file-name config-cache-file))
+
+(define (spool-user name)
+  (false-if-exception (getpw name)))
 
-(define (valid-user user-name)
-  (setpwent)
-  (do ((entry (getpw) (getpw)))
-      ((or (not entry)
-           (string=? (passwd:name entry) user-name))
-       (endpwent)
-       entry)))
+
+
+;; Procedure to build a table of all the users in the passwd database, indexed
+;; by user name, so that we can check that the owner of each crontab is a
+;; legitimate user (it may happen that a user is removed after creating a
+;; crontab) without scanning the whole database for every file. The table is
+;; built once each time the crontabs are read in at start-up.
+
+(define (passwd-table)
+  (let ((table (make-hash-table)))
+    (setpwent)
+    (do ((entry (getpw) (getpw)))
+        ((not entry)
+         (endpwent)
+         table)
+      (if (not (hash-ref table (passwd:name entry)))
+          (hash-set! table (passwd:name entry) entry)))))
+
+
+
+;; The parsed contents of the crontabs in the spool are kept in the cache file
+;; between runs of the daemon (see mcron.c for the format). A cached crontab is
+;; only used if it has the same modification time, size and inode number as the
+;; file in the spool now; otherwise the file has changed and is read again.
+
+(define (read-crontab-cache)
+  (let ((cache (make-hash-table)))
+    (for-each (lambda (record) (hash-set! cache (car record) record))
+              (c-read-job-cache crontab-cache-file))
+    cache))
+
+(define (crontab-cache-record file-name details entries)
+  (list file-name
+        (stat:mtime details)
+        (stat:size details)
+        (stat:ino details)
+        entries))
+
+(define (cached-crontab-entries cache file-name details)
+  (let ((record (hash-ref cache file-name)))
+    (and record
+         (equal? (list-head record 4)
+                 (list-head (crontab-cache-record file-name details '()) 4))
+         (list-ref record 4))))
+
+
+
+;; Crontabs are parsed in batches, at start-up and when they change, and we keep
+;; track of how long this takes (see the metrics module).
+
+(use-modules (mcron metrics))
+
+(define parse-metric
+  (define-histogram "mcron_crontab_parse_seconds"
+    "Time taken to parse each batch of crontabs."
+    '(0.001 0.01 0.1 1 10 60)))
+
+(define parsed-metric
+  (define-counter "mcron_crontabs_parsed_total"
+    "Crontab files parsed."))
+
+(define (parse-crontab-files file-paths)
+  (let* ((start (metrics-clock))
+         (parsed (read-vixie-files-entries file-paths)))
+    (observe! parse-metric (- (metrics-clock) start))
+    (counter-add! parsed-metric (length file-paths))
+    parsed))
 
 
 
@@ -346,26 +629,91 @@ Report bugs to " config-package-bugreport ".\n
 ;; appropriate user. Note that only the root user should be able to perform this
 ;; operation, but we leave it to the permissions on the /var/cron/tabs directory
 ;; to enforce this.
+;;
+;; Crontabs which have not changed since the last time are taken from the cache.
+;; All the others are parsed together in one batch (on several threads if
+;; possible), and then all the jobs are added. When we are done the cache is
+;; rewritten with the entries of all the crontabs we have read.
 
-(use-modules (srfi srfi-2))  ;; For and-let*.
+(use-modules (srfi srfi-1)   ;; For filter-map.
+             (srfi srfi-2))  ;; For and-let*.
 
-(define (process-files-in-system-directory)
+(define (spool-crontabs users)
   (catch #t
          (lambda ()
-           (let ((directory (opendir config-spool-dir)))
-             (do ((file-name (readdir directory) (readdir directory)))
-                 ((eof-object? file-name))
-               (and-let* ((user (valid-user file-name)))
-                         (set-configuration-user user)         ;; / ?? !!!!
-                         (catch-mcron-error
-                          (read-vixie-file (string-append config-spool-dir
-                                                          "/"
-                                                          file-name)))))))
+           (let ((directory (opendir spool-directory)))
+             (do ((file-name (readdir directory) (readdir directory))
+                  (crontabs '()
+                            (or (and-let* (((shard-owns? file-name))
+                                           (user (hash-ref users file-name))
+                                           (file-path (string-append
+                                                       spool-directory
+                                                       "/"
+                                                       file-name))
+                                           (details (false-if-exception
+                                                     (stat file-path))))
+                                          (cons (list file-name
+                                                      file-path
+                                                      user
+                                                      details)
+                                                crontabs))
+                                crontabs)))
+                 ((eof-object? file-name)
+                  (closedir directory)
+                  (reverse! crontabs)))))
          (lambda (key . args)
            (mcron-error
             4
             "You do not have permission to access the system crontabs."))))
 
+(define (process-files-in-system-directory)
+  (let* ((crontabs (spool-crontabs (passwd-table)))
+         (cache (read-crontab-cache))
+         (cached (map (lambda (crontab)
+                        (cached-crontab-entries cache
+                                                (car crontab)
+                                                (list-ref crontab 3)))
+                      crontabs))
+         (parsed (parse-crontab-files
+                  (filter-map (lambda (crontab entries)
+                                (and (not entries) (cadr crontab)))
+                              crontabs
+                              cached)))
+         (new-cache '()))
+    (for-each (lambda (crontab entries)
+                (let ((entries (or entries
+                                   (let ((entries (car parsed)))
+                                     (set! parsed (cdr parsed))
+                                     entries))))
+                  (set-configuration-user (list-ref crontab 2))
+                  (catch-mcron-error
+                   (if entries
+                       (begin
+                         (replay-vixie-entries (cadr crontab) entries)
+                         (set! new-cache
+                               (cons (crontab-cache-record (car crontab)
+                                                           (list-ref crontab 3)
+                                                           entries)
+                                     new-cache)))))))
+              crontabs
+              cached)
+    (c-write-job-cache crontab-cache-file new-cache)))
+
+
+
+;; When running as a cron daemon we ask the C wrapper to watch the spool
+;; directory and /etc/crontab for changes (unless the user has asked us not to
+;; bother with /etc/crontab). If this is possible crontab-watch will be the file
+;; descriptor to wait on for news of changes, otherwise it will be #f.
+
+(define crontab-watch
+  (and (eq? command-type 'cron)
+       (not schedule-request)
+       (c-watch-crontabs spool-directory
+                         (if (option-ref options 'noetc #f)
+                             #f
+                             "/etc/crontab"))))
+
 
 
 ;; Having defined all the necessary procedures for scanning various sets of
@@ -387,7 +735,7 @@ Report bugs to " config-package-bugreport ".\n
    (catch-mcron-error
     (read-vixie-file "/etc/crontab" parse-system-vixie-line))
    (use-user-job-list)
-   (if (not (option-ref options 'noetc #f))
+   (if (not (or (option-ref options 'noetc #f) crontab-watch))
        (begin
          (display
 "WARNING: cron will check for updates to /etc/crontab EVERY MINUTE. If you do\n
@@ -402,17 +750,16 @@ option.\n")
 
 
 ;; If the user has requested a schedule of jobs that will run, we provide the
-;; information here and then get out.
-;;
-;; Start by determining the number of time points in the future that output is
-;; required for. This may be provided on the command line as a parameter to the
-;; --schedule option, or else we assume a default of 8. Finally, ensure that the
-;; count is some positive integer.
-
-(and-let* ((count (option-ref options 'schedule #f)))
-          (set! count (string->number count))
-          (display (get-schedule (if (<= count 0) 1 count)))
-          (quit))
+;; information here and then get out. The schedule is worked out without
+;; disturbing the jobs, so the same is done for a running daemon when asked
+;; over its socket (see the control socket below).
+
+(if schedule-request
+    (begin
+      (display (get-schedule (car schedule-request)
+                             #:from (cadr schedule-request)
+                             #:until (caddr schedule-request)))
+      (quit)))
     
 
 
@@ -425,8 +772,10 @@ option.\n")
       (if (not (eqv? (primitive-fork) 0))
           (quit))
       (setsid)
+      (if shard-name
+          (take-lease-or-quit 50))
       (if (eq? command-type 'cron)
-          (with-output-to-file config-pid-file
+          (with-output-to-file pid-file
             (lambda () (display (getpid)) (newline))))))
 
 
@@ -434,7 +783,7 @@ option.\n")
 ;; If we are running as cron or crond, we establish a socket to listen for
 ;; updates from a crontab program. This is put into fd-list so that we can
 ;; inform the main wait-run-wait execution loop to listen for incoming messages
-;; on this socket.
+;; on this socket. The crontab watch, if there is one, goes in there too.
 
 (define fd-list '())
 
@@ -442,40 +791,651 @@ option.\n")
     (catch #t
            (lambda ()
              (let ((socket (socket AF_UNIX SOCK_STREAM 0)))
-               (bind socket AF_UNIX config-socket-file)
+               (bind socket AF_UNIX socket-file)
                (listen socket 5)
+               (fcntl socket F_SETFL (logior O_NONBLOCK
+                                             (fcntl socket F_GETFL)))
                (set! fd-list (list socket))))
            (lambda (key . args)
-             (delete-file config-pid-file)
+             (delete-file pid-file)
              (mcron-error 1
                           "Cannot bind to UNIX socket "
-                          config-socket-file))))
+                          socket-file))))
+
+(if crontab-watch
+    (set! fd-list (append fd-list (list crontab-watch))))
 		     
 
 
 
-;; This function is called whenever a message comes in on the above socket. We
-;; read a user name from the socket, dealing with the "/etc/crontab" special
-;; case, remove all the user's jobs from the job list, and then re-read the
-;; user's updated file. In the special case we drop all the system jobs and
-;; re-read the /etc/crontab file.
+;; A crontab with an error in it must not bring the running daemon down: the
+;; error is reported, and the user keeps the jobs loaded before (see
+;; reload-user-jobs in the core).
 
-(define (process-update-request)
-  (let* ((socket (car (accept (car fd-list))))
-         (user-name (read-line socket)))
-    (close socket)
+(defmacro report-mcron-error (. body)
+  `(catch 'mcron-error
+          (lambda ()
+            ,@body)
+          (lambda (key exit-code . msg)
+            (apply mcron-error #f msg))))
+
+
+;; Re-read the named crontabs: each is either "/etc/crontab", in which case we
+;; drop all the system jobs and re-read the /etc/crontab file, or the name of a
+;; user, in which case we re-read the user's updated file, replacing the user's
+;; jobs with the new ones (the core keeps the jobs from lines which have not
+;; changed, along with their next run times). Names which are not those of
+;; users are ignored, as are repeats. The users' crontabs are all parsed in one
+;; batch (on several threads if possible) before any jobs are touched.
+
+(define (reload-crontabs names)
+  (let* ((names (delete-duplicates names))
+         (users (filter-map (lambda (name)
+                              (and (not (string=? name "/etc/crontab"))
+                                   (shard-owns? name)
+                                   (and=> (spool-user name)
+                                          (lambda (user) (cons name user)))))
+                            names))
+         (file-paths (map (lambda (user)
+                            (string-append spool-directory "/" (car user)))
+                          users))
+         (parsed (parse-crontab-files file-paths)))
     (set-configuration-time (current-time))
-    (catch-mcron-error
-     (if (string=? user-name "/etc/crontab")
-         (begin
-           (clear-system-jobs)
-           (use-system-job-list)
-           (read-vixie-file "/etc/crontab" parse-system-vixie-line)
-           (use-user-job-list))
-         (let ((user (getpw user-name)))
-           (remove-user-jobs user)
-           (set-configuration-user user)
-           (read-vixie-file (string-append config-spool-dir "/" user-name)))))))
+    (if (member "/etc/crontab" names)
+        (begin
+          (clear-system-jobs)
+          (use-system-job-list)
+          (report-mcron-error
+           (read-vixie-file "/etc/crontab" parse-system-vixie-line))
+          (use-user-job-list)))
+    (for-each (lambda (user file-path entries)
+                (set-configuration-user (cdr user))
+                (report-mcron-error
+                 (reload-user-jobs (cdr user)
+                                   (lambda ()
+                                     (if entries
+                                         (replay-vixie-entries file-path
+                                                               entries))))))
+              users
+              file-paths
+              parsed)))
+
+
+;; Crontabs which are to be re-read are noted here as the requests come in, and
+;; all re-read together once everything which woke us up has been dealt with.
+
+(define pending-reloads '())
+
+(define (queue-reloads! names)
+  (set! pending-reloads (append pending-reloads names)))
+
+
+
+;; This function is called whenever the crontab watch tells us that files have
+;; changed. Each crontab is re-read just once however many times it changed. If
+;; the kernel lost track of the changes, we re-read every crontab there is.
+
+(define (spool-directory-names)
+  (catch #t
+         (lambda ()
+           (let ((directory (opendir spool-directory)))
+             (do ((file-name (readdir directory) (readdir directory))
+                  (names '() (if (string-prefix? "." file-name)
+                                 names
+                                 (cons file-name names))))
+                 ((eof-object? file-name) (closedir directory) names))))
+         (lambda (key . args) '())))
+
+(define (process-crontab-events)
+  (let ((names (c-read-crontab-events)))
+    (queue-reloads! (if (eq? names #t)
+                        (cons "/etc/crontab" (spool-directory-names))
+                        names))))
+
+
+
+;; The control socket. Connections are accepted without blocking, as many as
+;; are waiting each time the socket becomes ready, and kept open, with their
+;; sockets in the list of files the main loop waits on, until the other end
+;; closes them or asks us to. There are two ways of talking to us.
+;;
+;; The old way, used by the crontab program, is to write the name of a crontab
+;; (a user name or "/etc/crontab") and close the connection, whereupon the
+;; crontab is re-read.
+;;
+;; The new way is to start with the line "MCRON 1", giving the version of the
+;; protocol, and then send any number of requests, one per line. Each request,
+;; and the opening line, gets a reply made up of a status line, which starts
+;; with OK or ERR, then any number of lines of data, then a line holding just a
+;; dot; data lines which start with a dot have another put in front of them. The
+;; requests are
+;;
+;;   reload NAME...               re-read the named crontabs
+;;   status [USER]                list the jobs: user, next time, number
+;;                                  running, pending flag, description, number
+;;                                  of runs, last exit status, last running
+;;                                  time and greatest number running at once
+;;   schedule COUNT [FROM [UNTIL]]  list the jobs which will run at the next
+;;                                  COUNT times (`-' for no limit), within the
+;;                                  window of times if given: time, user and
+;;                                  description (within limits; see below)
+;;   metrics                      the metrics, in Prometheus text format
+;;   quit                         close the connection
+;;
+;; with the fields of the data lines separated by tabs and times given as
+;; seconds since the epoch. Root may ask about and reload anything, others only
+;; their own crontab and jobs; we know who is asking from the credentials of the
+;; connection.
+;;
+;; Reloads from all the connections which woke us up are gathered together and
+;; done in one go, and only then answered; a connection which has asked for a
+;; reload is not read again until this has happened, so its later requests see
+;; the new jobs.
+;;
+;; The sockets are not allowed to block, so that a client which stops reading
+;; its replies cannot hold up the jobs: the replies are queued, and sent as the
+;; socket will take them, the main loop waking us when it is writable again. A
+;; client which lets more than max-reply-backlog bytes pile up is dropped.
+;;
+;; Each connection is kept as
+;;
+;;  (vector socket uid buffer state output)
+;;
+;; where uid is that of the process at the other end, buffer holds what has been
+;; read but not yet dealt with, state is one of new (nothing read yet), session
+;; (talking the new protocol), waiting (for a reload), closing (once the output
+;; has gone) or closed, and output is a bytevector of the replies not yet sent.
+
+(use-modules (rnrs bytevectors))
+
+(define max-connections 32)
+(define max-request-length 4096)
+(define max-reply-backlog (* 8 1024 1024))
+
+(define connections '())
+
+(define (connection:socket connection) (vector-ref connection 0))
+(define (connection:uid connection)    (vector-ref connection 1))
+(define (connection:buffer connection) (vector-ref connection 2))
+(define (connection:state connection)  (vector-ref connection 3))
+(define (connection:output connection) (vector-ref connection 4))
+
+(define (set-connection:buffer! connection buffer)
+  (vector-set! connection 2 buffer))
+(define (set-connection:state! connection state)
+  (vector-set! connection 3 state))
+(define (set-connection:output! connection output)
+  (vector-set! connection 4 output))
+
+
+(define (accept-connections)
+  (let loop ()
+    (and-let* ((client (false-if-exception (accept (car fd-list)))))
+      (if (< (length connections) max-connections)
+          (begin
+            (fcntl (car client) F_SETFL (logior O_NONBLOCK
+                                                (fcntl (car client) F_GETFL)))
+            (set! connections
+                  (append connections
+                          (list (vector (car client)
+                                        (c-peer-uid (car client))
+                                        ""
+                                        'new
+                                        (make-bytevector 0))))))
+          (close (car client)))
+      (loop))))
+
+
+(define (close-connection! connection)
+  (catch #t (lambda () (close (connection:socket connection))) noop)
+  (set-connection:state! connection 'closed))
+
+
+;; Close the connection once the replies queued on it have been sent.
+
+(define (finish-connection! connection)
+  (if (not (eq? (connection:state connection) 'closed))
+      (begin
+        (set-connection:state! connection 'closing)
+        (flush-connection! connection))))
+
+
+;; Send as much of the queued output as the socket will take now.
+
+(define (flush-connection! connection)
+  (let* ((output (connection:output connection))
+         (sent (if (zero? (bytevector-length output))
+                   0
+                   (c-send-partial (connection:socket connection) output 0))))
+    (cond ((not sent) (close-connection! connection))
+          ((< sent (bytevector-length output))
+           (let ((rest (make-bytevector (- (bytevector-length output) sent))))
+             (bytevector-copy! output sent rest 0 (bytevector-length rest))
+             (set-connection:output! connection rest)))
+          (else
+           (set-connection:output! connection (make-bytevector 0))
+           (if (eq? (connection:state connection) 'closing)
+               (close-connection! connection))))))
+
+
+(define (send-reply connection status lines)
+  (if (not (eq? (connection:state connection) 'closed))
+      (let* ((reply (string->utf8
+                     (with-output-to-string
+                       (lambda ()
+                         (display status)
+                         (newline)
+                         (for-each (lambda (line)
+                                     (if (string-prefix? "." line)
+                                         (display "."))
+                                     (display line)
+                                     (newline))
+                                   lines)
+                         (display ".\n")))))
+             (output (connection:output connection))
+             (size (+ (bytevector-length output) (bytevector-length reply))))
+        (if (> size max-reply-backlog)
+            (close-connection! connection)
+            (let ((queued (make-bytevector size)))
+              (bytevector-copy! output 0 queued 0 (bytevector-length output))
+              (bytevector-copy! reply 0 queued (bytevector-length output)
+                                (bytevector-length reply))
+              (set-connection:output! connection queued)
+              (flush-connection! connection))))))
+
+
+;; Read whatever the other end has sent without waiting for more, adding it to
+;; the buffer. Return #f if the other end has closed the connection.
+
+(define (read-connection! connection)
+  (let ((socket (connection:socket connection)))
+    (catch #t
+           (lambda ()
+             (let loop ((chars '()))
+               (let ((char (if (char-ready? socket)
+                               (read-char socket)
+                               #f)))
+                 (if (char? char)
+                     (loop (cons char chars))
+                     (begin
+                       (set-connection:buffer!
+                        connection
+                        (string-append (connection:buffer connection)
+                                       (reverse-list->string chars)))
+                       (not (eof-object? char)))))))
+           (lambda (key . args) #f))))
+
+
+;; Tidy up a string for use as one field of a data line.
+
+(define (reply-field string)
+  (string-map (lambda (char)
+                (if (memv char '(#\tab #\newline #\return)) #\space char))
+              string))
+
+
+;; An exit status as the shell would show it: the exit code of a process which
+;; exited, or 128 plus the number of the signal which killed it.
+
+(define (exit-status-field status)
+  (cond ((not status) "-")
+        ((status:term-sig status)
+         => (lambda (signal) (number->string (+ 128 signal))))
+        (else (number->string (or (status:exit-val status) 0)))))
+
+
+;; Work out which user a status or schedule request is about: the named one
+;; for root (or everyone if none is named), otherwise the asker themselves, who
+;; may not ask about anybody else. Returns #t for everyone, a UID, or #f if the
+;; request is not allowed.
+
+(define (request-user connection user-name)
+  (let ((uid (connection:uid connection)))
+    (cond ((not uid) #f)
+          ((eqv? uid 0)
+           (if user-name
+               (and=> (false-if-exception (getpw user-name)) passwd:uid)
+               #t))
+          ((not user-name) uid)
+          ((equal? (false-if-exception (passwd:name (getpwuid uid)))
+                   user-name)
+           uid)
+          (else #f))))
+
+(define (request-number field)
+  (and (not (string=? field "-"))
+       (let ((number (string->number field)))
+         (and number (exact? number) (>= number 0) number))))
+
+
+(define (status-request connection arguments)
+  (let ((user (request-user connection
+                            (and (pair? arguments) (car arguments)))))
+    (cond ((> (length arguments) 1)
+           (send-reply connection "ERR Bad status request" '()))
+          ((not user)
+           (send-reply connection "ERR Permission denied" '()))
+          (else
+           (send-reply connection
+                       "OK"
+                       (map (lambda (details)
+                              (string-join
+                               (list (reply-field (list-ref details 0))
+                                     (if (list-ref details 1)
+                                         (number->string (list-ref details 1))
+                                         "-")
+                                     (number->string (list-ref details 2))
+                                     (if (list-ref details 3) "1" "0")
+                                     (reply-field (list-ref details 4))
+                                     (number->string (list-ref details 5))
+                                     (exit-status-field (list-ref details 6))
+                                     (if (list-ref details 7)
+                                         (number->string
+                                          (exact->inexact
+                                           (list-ref details 7)))
+                                         "-")
+                                     (number->string (list-ref details 8)))
+                               "\t"))
+                            (job-status #:user (if (eq? user #t)
+                                                   #f
+                                                   user))))))))
+
+
+;; A schedule request is worked out in the daemon itself, so it may not ask for
+;; more than max-schedule-count times, nor (without a count) for a window of
+;; more than max-schedule-window seconds.
+
+(define max-schedule-count 10000)
+(define max-schedule-window (* 366 24 60 60))
+
+(define (schedule-request-too-large? fields)
+  (let ((count (car fields))
+        (from (or (and (> (length fields) 1) (cadr fields)) (current-time)))
+        (until (and (> (length fields) 2) (caddr fields))))
+    (if count
+        (> count max-schedule-count)
+        (> (- until from) max-schedule-window))))
+
+(define (schedule-request-reply connection arguments)
+  (let ((user (request-user connection #f))
+        (fields (map request-number arguments)))
+    (cond ((not user)
+           (send-reply connection "ERR Permission denied" '()))
+          ((or (null? fields)
+               (> (length fields) 3)
+               (not (or (car fields)
+                        (and (eqv? (length fields) 3) (caddr fields)))))
+           (send-reply connection "ERR Bad schedule request" '()))
+          ((schedule-request-too-large? fields)
+           (send-reply connection "ERR Schedule request too large" '()))
+          (else
+           (send-reply
+            connection
+            "OK"
+            (append-map
+             (lambda (time-jobs)
+               (map (lambda (job)
+                      (let ((details (job-details job)))
+                        (string-join
+                         (list (number->string (car time-jobs))
+                               (reply-field (list-ref details 0))
+                               (reply-field (list-ref details 4)))
+                         "\t")))
+                    (cdr time-jobs)))
+             (job-forecast (car fields)
+                           #:from (and (> (length fields) 1) (cadr fields))
+                           #:until (and (> (length fields) 2) (caddr fields))
+                           #:user (if (eqv? user 0) #f user))))))))
+
+
+(define (reload-request connection names)
+  (if (and (not (null? names))
+           (every (lambda (name)
+                    (or (eqv? (connection:uid connection) 0)
+                        (eqv? (request-user connection name)
+                              (connection:uid connection))))
+                  names))
+      (begin
+        (queue-reloads! names)
+        (set-connection:state! connection 'waiting))
+      (send-reply connection "ERR Permission denied" '())))
+
+
+(define (serve-request connection line)
+  (let ((words (string-tokenize line)))
+    (if (null? words)
+        (send-reply connection "ERR Empty request" '())
+        (let ((verb (car words))
+              (arguments (cdr words)))
+          (cond ((string=? verb "reload") (reload-request connection arguments))
+                ((string=? verb "status") (status-request connection arguments))
+                ((string=? verb "schedule")
+                 (schedule-request-reply connection arguments))
+                ((string=? verb "metrics")
+                 (send-reply connection
+                             "OK"
+                             (string-split (string-trim-right (metrics-text)
+                                                              #\newline)
+                                           #\newline)))
+                ((string=? verb "quit")
+                 (send-reply connection "OK" '())
+                 (finish-connection! connection))
+                (else
+                 (send-reply connection "ERR Unknown request" '())))))))
+
+
+;; Deal with all the complete lines in the connection's buffer, stopping if the
+;; connection has to wait for a reload or is closed.
+
+(define (serve-lines connection)
+  (let loop ()
+    (let* ((buffer (connection:buffer connection))
+           (end (string-index buffer #\newline)))
+      (if (and end (memq (connection:state connection) '(new session)))
+          (let ((line (string-trim-right (substring buffer 0 end) #\return)))
+            (set-connection:buffer! connection (substring buffer (+ end 1)))
+            (case (connection:state connection)
+              ((new)
+               (cond ((string=? line "MCRON 1")
+                      (set-connection:state! connection 'session)
+                      (send-reply connection "OK MCRON 1" '()))
+                     ((string-prefix? "MCRON " line)
+                      (send-reply connection "ERR Unsupported version" '())
+                      (finish-connection! connection))
+                     (else
+                      (queue-reloads! (list line))
+                      (close-connection! connection))))
+              (else
+               (catch #t
+                      (lambda () (serve-request connection line))
+                      (lambda (key . args)
+                        (send-reply connection "ERR Internal error" '())))))
+            (loop))))))
+
+
+(define (serve-connection connection)
+  (let ((open? (or (eq? (connection:state connection) 'closing)
+                   (read-connection! connection))))
+    (flush-connection! connection)
+    (serve-lines connection)
+    (cond ((memq (connection:state connection) '(closed closing waiting)))
+          ((> (string-length (connection:buffer connection))
+              max-request-length)
+           (close-connection! connection))
+          ((not open?)
+           (if (and (eq? (connection:state connection) 'new)
+                    (not (string-null? (connection:buffer connection))))
+               (queue-reloads! (list (connection:buffer connection))))
+           (close-connection! connection)))))
+
+
+;; Re-read all the crontabs which have been asked for, then answer the
+;; connections which were waiting for this and carry on with their requests
+;; (which may ask for more reloads).
+
+(define (apply-pending-reloads)
+  (if (not (null? pending-reloads))
+      (let ((names pending-reloads))
+        (set! pending-reloads '())
+        (reload-crontabs names)
+        (for-each (lambda (connection)
+                    (if (eq? (connection:state connection) 'waiting)
+                        (begin
+                          (set-connection:state! connection 'session)
+                          (send-reply connection "OK" '())
+                          (serve-lines connection))))
+                  connections)
+        (apply-pending-reloads))))
+
+
+;; The sockets the main loop is to wait on: those of the connections which may
+;; send us more, and those of the connections which have replies waiting to go.
+
+(define (connection-sockets)
+  (filter-map (lambda (connection)
+                (and (not (eq? (connection:state connection) 'closing))
+                     (connection:socket connection)))
+              connections))
+
+(define (connection-output-sockets)
+  (filter-map (lambda (connection)
+                (and (positive? (bytevector-length
+                                 (connection:output connection)))
+                     (connection:socket connection)))
+              connections))
+
+
+(define (process-control-requests ready)
+  (if (memq (car fd-list) ready)
+      (accept-connections))
+  (for-each serve-connection connections)
+  (apply-pending-reloads)
+  (set! connections
+        (filter (lambda (connection)
+                  (not (eq? (connection:state connection) 'closed)))
+                connections)))
+
+
+
+;; The daemon writes its metrics to a file every so often, for a collector to
+;; pick up.
+
+(define metrics-file-interval 15)
+
+(if (eq? command-type 'cron)
+    (add-housekeeping! metrics-file-interval
+                       (lambda ()
+                         (write-metrics-file
+                          (member-file-name config-metrics-file)))))
+
+
+
+;; The daemon keeps a journal of the runs of the jobs, so that when it starts
+;; again after being down it can make up the runs which the jobs with a catch-up
+;; policy have missed; those are started now, before the main loop.
+
+(if (eq? command-type 'cron)
+    (begin
+      (set-job-journal! #:directory (member-file-name config-journal-dir))
+      (catch-up-jobs)))
+
+
+
+;; The members of a shard group look at each other's leases every so often, as
+;; part of the housekeeping. When one has come or gone, the housekeeping writes
+;; to a pipe which the main loop waits on, and the main loop then moves the
+;; users whose owner has changed: we drop the jobs of those we no longer own,
+;; and read the crontabs of those we have gained (the jobs of a user we take
+;; over do not catch up on runs its old owner missed, as the journals are the
+;; members' own). Shard-members-seen is the list of live members which the
+;; jobs we have loaded were chosen by.
+;;
+;; The crontab program only tells the daemon on the usual socket about the
+;; changes it makes, and the crontab watch does not see changes made from other
+;; hosts on a network file system, so the members also look through the spool
+;; every spool-rescan-interval seconds for crontabs of their users which have
+;; appeared, changed or gone, by their modification times, sizes and inode
+;; numbers (kept in spool-details), and have them re-read in the same way.
+
+(define shard-pipe (and shard-name (pipe)))
+
+(define shard-members-seen (live-shard-members))
+
+(define shard-members-metric
+  (define-gauge "mcron_shard_members"
+    "The members of the shard group which are live."
+    #:thunk (lambda () (length (live-shard-members)))))
+
+(define spool-rescan-interval 30)
+
+(define spool-details (make-hash-table))
+
+(define (wake-for-shard)
+  (write-char #\! (cdr shard-pipe))
+  (force-output (cdr shard-pipe)))
+
+(define (check-shard-members)
+  (refresh-shard-members!)
+  (if (not (equal? (live-shard-members) shard-members-seen))
+      (wake-for-shard)))
+
+
+;; Return the names of our users whose crontabs have changed since the last
+;; look, and of those we knew of which have gone or are no longer ours.
+
+(define (spool-file-details name)
+  (and=> (false-if-exception (stat (string-append spool-directory "/" name)))
+         (lambda (details)
+           (list (stat:mtime details) (stat:size details) (stat:ino details)))))
+
+(define (rescan-spool)
+  (let ((seen (make-hash-table))
+        (changed '()))
+    (for-each (lambda (name)
+                (if (shard-owns? name)
+                    (let ((details (spool-file-details name)))
+                      (hash-set! seen name #t)
+                      (if (not (equal? details (hash-ref spool-details name)))
+                          (begin
+                            (hash-set! spool-details name details)
+                            (set! changed (cons name changed)))))))
+              (spool-directory-names))
+    (for-each (lambda (name)
+                (hash-remove! spool-details name)
+                (set! changed (cons name changed)))
+              (hash-fold (lambda (name details gone)
+                           (if (hash-ref seen name) gone (cons name gone)))
+                         '()
+                         spool-details))
+    changed))
+
+(define (check-spool)
+  (let ((changed (rescan-spool)))
+    (if (not (null? changed))
+        (begin
+          (queue-reloads! changed)
+          (wake-for-shard)))))
+
+(define (process-shard-changes)
+  (let ((previous shard-members-seen))
+    (while (char-ready? (car shard-pipe))
+      (read-char (car shard-pipe)))
+    (set! shard-members-seen (live-shard-members))
+    (queue-reloads!
+     (filter (lambda (name)
+               (let ((owned (shard-owns? name))
+                     (was-owned (shard-owns? name previous)))
+                 (if (and was-owned (not owned))
+                     (and=> (spool-user name) remove-user-jobs))
+                 (and owned (not was-owned))))
+             (spool-directory-names)))))
+
+(if (and shard-name (not schedule-request))
+    (begin
+      (set! fd-list (append fd-list (list (car shard-pipe))))
+      (rescan-spool)
+      (add-housekeeping! shard-check-interval check-shard-members)
+      (add-housekeeping! spool-rescan-interval check-spool)))
 
 
 
@@ -488,16 +1448,24 @@ option.\n")
 
 ;; (sigaction SIGCHLD (lambda (sig) noop) SA_RESTART)
 
+;; On Linux this is now done properly: SIGCHLD is blocked and read from a
+;; signalfd by the core's native event loop, which reaps children as soon as
+;; they die without disturbing the wait for the next job.
+
 
 
 ;; Now the main loop. Forever execute the run-job-loop procedure in the mcron
 ;; core, and when it drops out (can only be because a message has come in on the
-;; socket) we process the socket request before restarting the loop again.
-;; Sergey Poznyakoff: we can also drop out of run-job-loop because of a SIGCHLD,
-;; so must test fd-list.
+;; socket, a client can take more of its replies, or the crontab watch has seen
+;; some changes) we process the request before restarting the loop again.
 
 (catch-mcron-error
  (while #t
-        (run-job-loop fd-list)
-        (if (not (null? fd-list))
-            (process-update-request))))
+        (let ((ready (run-job-loop (append fd-list (connection-sockets))
+                                   (connection-output-sockets))))
+          (if (and crontab-watch (memv crontab-watch ready))
+              (process-crontab-events))
+          (if (and shard-pipe (memq (car shard-pipe) ready))
+              (process-shard-changes))
+          (if (eq? command-type 'cron)
+              (process-control-requests ready)))))
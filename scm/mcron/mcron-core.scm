@@ -19,8 +19,20 @@
 
 (define-module (mcron core)
   #:use-module (mcron environment)
+  #:use-module (mcron metrics)
   #:export     (add-job
                 remove-user-jobs
+                reload-user-jobs
+                set-job-limits!
+                set-job-output!
+                send-job-mail
+                set-job-journal!
+                sync-job-journal
+                catch-up-jobs
+                add-housekeeping!
+                job-forecast
+                job-details
+                job-status
                 get-schedule
                 run-job-loop
                    ;; These three are deprecated and not documented.
@@ -31,29 +43,45 @@
                 append-environment-mods))
 
 
-(use-modules (srfi srfi-1)    ;; For remove.
-             (srfi srfi-2))   ;; For and-let*.
+(use-modules (srfi srfi-1)    ;; For last.
+             (srfi srfi-2)    ;; For and-let*.
+             ((rnrs bytevectors) #:select (make-bytevector
+                                           bytevector-copy!
+                                           bytevector-length
+                                           bytevector-u8-ref
+                                           bytevector-u32-native-ref
+                                           bytevector-u32-native-set!
+                                           bytevector-s32-native-ref
+                                           bytevector-s32-native-set!
+                                           bytevector-s64-native-ref
+                                           bytevector-s64-native-set!
+                                           bytevector-ieee-double-native-ref
+                                           bytevector-ieee-double-native-set!
+                                           string->utf8))
+             ((rnrs io ports) #:select (put-bytevector)))
 
 
 
-;; The list of all jobs known to the system. Each element of the list is
+;; The lists of all jobs known to the system. Each element of a list is
 ;;
-;;  (vector user next-time-function action environment displayable next-time)
+;;  (vector handle schedule action)
 ;;
-;; where action must be a procedure, and the environment is an alist of
-;; modifications that need making to the UNIX environment before the action is
-;; run. The next-time element is the only one that is modified during the
-;; running of a cron process (i.e. all the others are set once and for all at
-;; configuration time).
+;; where the handle is the index of the job's record in the job table (see
+;; below), which holds everything else about it. The schedule (see below) is
+;; shared by all the jobs which run at the same times, and is set to #f when
+;; the job is removed from the system. The action is a procedure, or #f if the
+;; job simply runs a shell command, in which case the record has the command.
 ;;
-;; The reason we maintain two lists is that jobs in /etc/crontab may be placed
-;; in one, and all other jobs go in the other. This makes it possible to remove
-;; all the jobs in the first list in one go, and separately we can remove all
-;; jobs from the second list which belong to a particular user. This behaviour
-;; is required for full vixie compatibility.
+;; The reason we maintain two sets of lists is that jobs in /etc/crontab may be
+;; placed in one, and all other jobs go in the others. This makes it possible to
+;; remove all the jobs in the first list in one go, and separately we can remove
+;; all jobs which belong to a particular user. This behaviour is required for
+;; full vixie compatibility. The user jobs are kept in a hash table indexed by
+;; UID, with a list of the jobs belonging to that user in each entry, so that
+;; the jobs of one user can be found without looking at anybody else's.
 
 (define system-job-list '())
-(define user-job-list '())
+(define user-job-table (make-hash-table))
 
 (define configuration-source 'user)
 
@@ -62,121 +90,922 @@
 
 
 
+;; A big system has a great many jobs, but far fewer distinct users,
+;; environments and commands: all the jobs in a crontab have the same user, and
+;; usually the same environment, and the same commands turn up in many
+;; crontabs. These are interned in the tables below, so that each distinct one
+;; is kept only once, and the jobs refer to them by number. An intern table is
+;;
+;;  (vector index keys objects counts free size)
+;;
+;; where index is a hash table from each key to its number, keys and objects
+;; are vectors holding the key and the object interned under each number (the
+;; object is usually the key itself), counts is a bytevector holding the number
+;; of references to each as a 32-bit integer, free is a list of the numbers
+;; which are not in use, and size is the number of numbers which have ever been
+;; used. An object is forgotten when its last reference is released.
+
+(define (make-intern-table)
+  (vector (make-hash-table) (make-vector 16 #f) (make-vector 16 #f)
+          (make-bytevector (* 16 4) 0) '() 0))
+
+(define (intern-table:index table)   (vector-ref table 0))
+(define (intern-table:keys table)    (vector-ref table 1))
+(define (intern-table:objects table) (vector-ref table 2))
+(define (intern-table:counts table)  (vector-ref table 3))
+(define (intern-table:free table)    (vector-ref table 4))
+(define (intern-table:size table)    (vector-ref table 5))
+
+
+(define (intern-count table id)
+  (bytevector-u32-native-ref (intern-table:counts table) (* id 4)))
+
+(define (set-intern-count! table id count)
+  (bytevector-u32-native-set! (intern-table:counts table) (* id 4) count))
+
+
+;; Make room for one more number at the end of the table.
+
+(define (grow-intern-table! table)
+  (let ((size (vector-length (intern-table:keys table))))
+    (if (>= (intern-table:size table) size)
+        (let ((keys (make-vector (* 2 size) #f))
+              (objects (make-vector (* 2 size) #f))
+              (counts (make-bytevector (* 2 size 4) 0)))
+          (vector-move-left! (intern-table:keys table) 0 size keys 0)
+          (vector-move-left! (intern-table:objects table) 0 size objects 0)
+          (bytevector-copy! (intern-table:counts table) 0 counts 0 (* size 4))
+          (vector-set! table 1 keys)
+          (vector-set! table 2 objects)
+          (vector-set! table 3 counts)))))
+
+
+;; Return the number of the key in the table, adding a reference to it. If the
+;; key is new, the object stored under it is the result of calling make.
+
+(define* (intern! table key #:optional (make (lambda () key)))
+  (let ((id (hash-ref (intern-table:index table) key)))
+    (if id
+        (set-intern-count! table id (+ (intern-count table id) 1))
+        (begin
+          (if (null? (intern-table:free table))
+              (begin
+                (grow-intern-table! table)
+                (set! id (intern-table:size table))
+                (vector-set! table 5 (+ id 1)))
+              (begin
+                (set! id (car (intern-table:free table)))
+                (vector-set! table 4 (cdr (intern-table:free table)))))
+          (vector-set! (intern-table:keys table) id key)
+          (vector-set! (intern-table:objects table) id (make))
+          (set-intern-count! table id 1)
+          (hash-set! (intern-table:index table) key id)))
+    id))
+
+(define (interned table id)
+  (vector-ref (intern-table:objects table) id))
+
+(define (release! table id)
+  (let ((count (- (intern-count table id) 1)))
+    (set-intern-count! table id count)
+    (if (<= count 0)
+        (begin
+          (hash-remove! (intern-table:index table)
+                        (vector-ref (intern-table:keys table) id))
+          (vector-set! (intern-table:keys table) id #f)
+          (vector-set! (intern-table:objects table) id #f)
+          (vector-set! table 4 (cons id (intern-table:free table)))))))
+
+
+;; The users (passwd entries), environments (alists of environment
+;; modifications, as from get-current-environment-mods-copy, which must not be
+;; changed afterwards) and strings (commands and displayables) of the jobs.
+;; Jobs with the same command, environment and user also share a launcher (see
+;; below), interned under a list of the numbers of those three.
+
+(define user-table (make-intern-table))
+(define environment-table (make-intern-table))
+(define string-table (make-intern-table))
+(define launcher-table (make-intern-table))
+
+
+
+;; Everything about a job apart from its schedule and action is kept in a
+;; fixed-size record in the job table, a bytevector which holds the records one
+;; after the other, so that the jobs cost the garbage collector nothing to look
+;; after, and there is little for a fork to copy. Each record is laid out as
+;;
+;;   offset  field
+;;    0      user number
+;;    4      environment number
+;;    8      displayable number
+;;   12      command number, or #xffffffff if the job's action is a procedure
+;;   16      launcher number, or #xffffffff if it has none
+;;   20      spread
+;;   24      running
+;;   28      overlap (0 for run, 1 for skip, 2 for queue)
+;;   32      pending (1 or 0)
+;;   36      runs
+;;   40      status (signed)
+;;   44      peak
+;;   48      duration (a double)
+;;   56      catch-up (0 for none, 1 for once, 2 for all)
+;;   60      catch-up limit
+;;
+;; all as 32-bit integers in the machine's byte order unless noted. The
+;; environment is an alist of modifications that need making to the UNIX
+;; environment before the action is run, and the launcher is a native object
+;; which can start the job's command without forking the whole of this process
+;; (see run-jobs below). The overlap policy and spread control how the job is
+;; dispatched (see below); running is the number of instances of the job which
+;; are currently running, and pending is true while an instance is waiting to
+;; be started. Then come the statistics of what happened the last times the
+;; job ran, and the job's catch-up policy (see below). Only running, pending
+;; and the statistics change once the job is made.
+;;
+;; The records of jobs which have been removed, and are neither running nor
+;; waiting to run, are put on the free-job-records list to be used again.
+
+(define job-record-size 64)
+(define no-number #xffffffff)
+
+(define job-records (make-bytevector (* 64 job-record-size) 0))
+(define job-record-count 0)
+(define free-job-records '())
+(define live-job-count 0)
+
+(define overlap-policies #(run skip queue))
+(define catch-up-policies #(none once all))
+
+
+(define (job-field job offset)
+  (bytevector-u32-native-ref job-records
+                             (+ (* (vector-ref job 0) job-record-size) offset)))
+
+(define (set-job-field! job offset value)
+  (bytevector-u32-native-set! job-records
+                              (+ (* (vector-ref job 0) job-record-size) offset)
+                              value))
+
+
 ;; Convenience functions for getting and setting the elements of a job object.
 
-(define (job:user job)                (vector-ref job 0))
-(define (job:next-time-function job)  (vector-ref job 1))
-(define (job:action job)              (vector-ref job 2))
-(define (job:environment job)         (vector-ref job 3))
-(define (job:displayable job)         (vector-ref job 4))
-(define (job:next-time job)           (vector-ref job 5))
+(define (job:schedule job)    (vector-ref job 1))
+(define (job:user job)        (interned user-table (job-field job 0)))
+(define (job:environment job) (interned environment-table (job-field job 4)))
+(define (job:displayable job) (interned string-table (job-field job 8)))
+(define (job:spread job)      (job-field job 20))
+(define (job:running job)     (job-field job 24))
+(define (job:overlap job)     (vector-ref overlap-policies (job-field job 28)))
+(define (job:pending job)     (eqv? (job-field job 32) 1))
+(define (job:runs job)        (job-field job 36))
+(define (job:peak job)        (job-field job 44))
+(define (job:catch-up job)    (vector-ref catch-up-policies (job-field job 56)))
+(define (job:catch-up-limit job) (job-field job 60))
+
+(define (job:command job)
+  (let ((id (job-field job 12)))
+    (and (not (eqv? id no-number)) (interned string-table id))))
+
+(define (job:launcher job)
+  (let ((id (job-field job 16)))
+    (and (not (eqv? id no-number)) (interned launcher-table id))))
+
+(define (job:action job)
+  (or (vector-ref job 2)
+      (let ((command (job:command job)))
+        (lambda () (system command)))))
+
+(define (job:status job)
+  (and (> (job:runs job) 0)
+       (bytevector-s32-native-ref job-records
+                                  (+ (* (vector-ref job 0) job-record-size)
+                                     40))))
+
+(define (job:duration job)
+  (and (> (job:runs job) 0)
+       (bytevector-ieee-double-native-ref job-records
+                                          (+ (* (vector-ref job 0)
+                                                job-record-size)
+                                             48))))
+
+(define (set-job:schedule! job schedule) (vector-set! job 1 schedule))
+(define (set-job:running! job running)   (set-job-field! job 24 running))
+(define (set-job:pending! job pending)   (set-job-field! job 32 (if pending 1 0)))
+(define (set-job:peak! job peak)         (set-job-field! job 44 peak))
+
+(define (set-job:outcome! job status duration)
+  (let ((offset (* (vector-ref job 0) job-record-size)))
+    (set-job-field! job 36 (+ (job:runs job) 1))
+    (bytevector-s32-native-set! job-records (+ offset 40) status)
+    (bytevector-ieee-double-native-set! job-records (+ offset 48)
+                                        (exact->inexact duration))))
+
+
+;; Take a record for a new job, from the free list if there is one there, and
+;; otherwise from the end of the table (making the table bigger if need be).
+
+(define (allocate-job-record!)
+  (set! live-job-count (+ live-job-count 1))
+  (if (null? free-job-records)
+      (let ((size (bytevector-length job-records)))
+        (if (>= (* (+ job-record-count 1) job-record-size) size)
+            (let ((records (make-bytevector (* 2 size) 0)))
+              (bytevector-copy! job-records 0 records 0 size)
+              (set! job-records records)))
+        (set! job-record-count (+ job-record-count 1))
+        (- job-record-count 1))
+      (let ((handle (car free-job-records)))
+        (set! free-job-records (cdr free-job-records))
+        handle)))
+
+
+;; Make a job in a new record, given the numbers of its interned parts.
+
+(define (make-job schedule action user-id environment-id displayable-id
+                  command-id launcher-id overlap spread catch-up
+                  catch-up-limit)
+  (let ((job (vector (allocate-job-record!) schedule action)))
+    (for-each (lambda (offset value) (set-job-field! job offset value))
+              '(0 4 8 12 16 20 24 28 32 36 40 44 56 60)
+              (list user-id environment-id displayable-id command-id
+                    launcher-id (min spread no-number) 0
+                    (case overlap ((skip) 1) ((queue) 2) (else 0))
+                    0 0 0 0
+                    (case catch-up ((once) 1) ((all) 2) (else 0))
+                    (min catch-up-limit no-number)))
+    job))
+
+
+;; Once a job has been removed, and is neither running nor waiting to run,
+;; nothing will look at its record again, so we let go of the things it refers
+;; to and put the record on the free list. The handle is cleared so that any
+;; stray use of the job fails rather than finding some other job's record.
+
+(define (job-forgotten? job) (not (vector-ref job 0)))
+
+(define (forget-job-if-idle! job)
+  (if (and (not (job-forgotten? job))
+           (not (job:schedule job))
+           (eqv? (job:running job) 0)
+           (not (job:pending job)))
+      (begin
+        (release! user-table (job-field job 0))
+        (release! environment-table (job-field job 4))
+        (release! string-table (job-field job 8))
+        (if (not (eqv? (job-field job 12) no-number))
+            (release! string-table (job-field job 12)))
+        (if (not (eqv? (job-field job 16) no-number))
+            (release! launcher-table (job-field job 16)))
+        (set! free-job-records (cons (vector-ref job 0) free-job-records))
+        (set! live-job-count (- live-job-count 1))
+        (vector-set! job 0 #f))))
+
+
+
+;; Most jobs in a real system share a handful of time specifications (every
+;; five minutes, every hour, ...), so rather than computing the next time for
+;; every job we group together the jobs which have the same specification, and
+;; compute the next time once for the whole group. Each group is a schedule
+;; object,
+;;
+;;  (vector key next-time-function next-time heap-index jobs job-count
+;;          base-time)
+;;
+;; where key is the normalized time specification (or #f if the specification
+;; cannot be shared, for example because it is an arbitrary procedure),
+;; next-time is the result of applying the next-time-function to base-time, the
+;; heap-index is private to the schedule queue below, and jobs is a list of the
+;; jobs in the group.
+;;
+;; When a job is removed its schedule is cleared but it is left on the jobs
+;; list, and the job-count is decremented; the jobs list is tidied up the next
+;; time it is walked. This means that removing a job costs the same however
+;; many other jobs share its schedule.
+
+(define (schedule:key schedule)                (vector-ref schedule 0))
+(define (schedule:next-time-function schedule) (vector-ref schedule 1))
+(define (schedule:next-time schedule)          (vector-ref schedule 2))
+(define (schedule:heap-index schedule)         (vector-ref schedule 3))
+(define (schedule:jobs schedule)               (vector-ref schedule 4))
+(define (schedule:job-count schedule)          (vector-ref schedule 5))
+(define (schedule:base-time schedule)          (vector-ref schedule 6))
+
+(define (set-schedule:heap-index! schedule index)
+  (vector-set! schedule 3 index))
+(define (set-schedule:jobs! schedule jobs) (vector-set! schedule 4 jobs))
+(define (set-schedule:job-count! schedule count)
+  (vector-set! schedule 5 count))
+
+
+;; Return the list of live jobs in the schedule, dropping any removed ones from
+;; it as we go.
+
+(define (schedule:live-jobs schedule)
+  (let ((jobs (filter job:schedule (schedule:jobs schedule))))
+    (set-schedule:jobs! schedule jobs)
+    jobs))
+
+
+;; The schedules which have a key are interned in this table, so that new jobs
+;; with the same time specification can join them.
+
+(define schedule-table (make-hash-table))
+
+
+
+;; The measurements of the scheduler's own work (see the metrics module). The
+;; times taken by the next-time functions and by the search for the next jobs
+;; to run are small, so their buckets are too.
+
+(define fast-buckets '(0.00001 0.0001 0.001 0.01 0.1 1))
+
+(define next-time-metric
+  (define-histogram "mcron_next_time_seconds"
+    "Time taken to compute the next time a schedule is due."
+    fast-buckets))
+
+(define find-next-metric
+  (define-histogram "mcron_find_next_seconds"
+    "Time taken to find the schedules which are due next."
+    fast-buckets))
+
+
+
+;; Every schedule with any jobs in it is held in a binary min-heap keyed on the
+;; next-time, so that the main loop can find the jobs which are to run soonest
+;; without scanning the whole job table. The heap lives in the first
+;; schedule-heap-size slots of the schedule-heap vector, which is doubled in
+;; size whenever it fills up. Each schedule records its own position in the
+;; heap, so that it can be removed or moved when its next-time changes in
+;; logarithmic time.
+;;
+;; The next-times of the schedules are also kept in the same order in
+;; schedule-heap-times, a bytevector of 64-bit integers, so that the heap is
+;; ordered without looking inside the schedules at all. A schedule which will
+;; never run again is given a time later than any real one.
+
+(define schedule-heap (make-vector 64 #f))
+(define schedule-heap-times (make-bytevector (* 64 8) 0))
+(define schedule-heap-size 0)
+
+(define never-time (- (expt 2 61) 1))
+
+
+(define (heap-time index)
+  (bytevector-s64-native-ref schedule-heap-times (* index 8)))
+
+(define (heap-place! schedule index)
+  (vector-set! schedule-heap index schedule)
+  (bytevector-s64-native-set! schedule-heap-times (* index 8)
+                              (or (schedule:next-time schedule) never-time))
+  (set-schedule:heap-index! schedule index))
+
 
+;; Move the schedule at index towards the root of the heap until its parent
+;; runs no later than it does.
 
+(define (heap-sift-up! index)
+  (let ((schedule (vector-ref schedule-heap index))
+        (time (heap-time index)))
+    (let loop ((index index))
+      (if (> index 0)
+          (let ((parent-index (quotient (- index 1) 2)))
+            (if (< time (heap-time parent-index))
+                (begin
+                  (heap-place! (vector-ref schedule-heap parent-index) index)
+                  (loop parent-index))
+                (heap-place! schedule index)))
+          (heap-place! schedule index)))))
 
-;; Remove jobs from the user-job-list belonging to this user.
+
+;; Move the schedule at index away from the root of the heap until neither of
+;; its children runs earlier than it does.
+
+(define (heap-sift-down! index)
+  (let ((schedule (vector-ref schedule-heap index))
+        (time (heap-time index)))
+    (let loop ((index index))
+      (let* ((left (+ (* index 2) 1))
+             (right (+ left 1))
+             (smallest
+              (cond ((>= left schedule-heap-size) #f)
+                    ((and (< right schedule-heap-size)
+                          (< (heap-time right) (heap-time left)))
+                     right)
+                    (else left))))
+        (if (and smallest (< (heap-time smallest) time))
+            (begin
+              (heap-place! (vector-ref schedule-heap smallest) index)
+              (loop smallest))
+            (heap-place! schedule index))))))
+
+
+(define (heap-insert! schedule)
+  (if (>= schedule-heap-size (vector-length schedule-heap))
+      (let ((new-heap (make-vector (* 2 (vector-length schedule-heap)) #f))
+            (new-times (make-bytevector (* 2 8 (vector-length schedule-heap))
+                                        0)))
+        (vector-move-left! schedule-heap 0 schedule-heap-size new-heap 0)
+        (bytevector-copy! schedule-heap-times 0 new-times 0
+                          (* 8 schedule-heap-size))
+        (set! schedule-heap new-heap)
+        (set! schedule-heap-times new-times)))
+  (heap-place! schedule schedule-heap-size)
+  (set! schedule-heap-size (+ schedule-heap-size 1))
+  (heap-sift-up! (- schedule-heap-size 1)))
+
+
+;; Take the schedule out of the heap by moving the last schedule in the heap
+;; into its place, and then restoring the heap order around that position.
+
+(define (heap-remove! schedule)
+  (let ((index (schedule:heap-index schedule)))
+    (if index
+        (begin
+          (set! schedule-heap-size (- schedule-heap-size 1))
+          (set-schedule:heap-index! schedule #f)
+          (if (< index schedule-heap-size)
+              (begin
+                (heap-place! (vector-ref schedule-heap schedule-heap-size)
+                             index)
+                (heap-sift-up! index)
+                (heap-sift-down! (schedule:heap-index
+                                  (vector-ref schedule-heap index)))))
+          (vector-set! schedule-heap schedule-heap-size #f)))))
+
+
+;; Compute a new next-time for the schedule, from the given base time, and move
+;; the schedule to its proper place in the heap.
+
+(define (advance-schedule! schedule base-time)
+  (let ((start (metrics-clock)))
+    (vector-set! schedule 2 ((schedule:next-time-function schedule) base-time))
+    (observe! next-time-metric (- (metrics-clock) start)))
+  (vector-set! schedule 6 base-time)
+  (let ((index (schedule:heap-index schedule)))
+    (if index
+        (begin
+          (heap-place! schedule index)
+          (heap-sift-up! index)
+          (heap-sift-down! (schedule:heap-index schedule))))))
+
+
+
+;; Find a schedule for a new job. If the job's time specification has a key and
+;; there is already a schedule with that key which has been computed from a
+;; time no later than the configuration time, and has not yet come due at the
+;; configuration time, then the job will first run at that schedule's
+;; next-time, and it can join it. Otherwise we make a new schedule, and intern
+;; it if it has a key.
+
+(define (find-schedule key time-proc configuration-time)
+  (let ((schedule (and key (hash-ref schedule-table key))))
+    (if (and schedule
+             (<= (schedule:base-time schedule) configuration-time)
+             (< configuration-time (schedule:next-time schedule)))
+        schedule
+        (let ((schedule (vector key time-proc #f #f '() 0 #f)))
+          (advance-schedule! schedule configuration-time)
+          (if key (hash-set! schedule-table key schedule))
+          schedule))))
+
+
+(define (schedule-add-job! schedule job)
+  (set-schedule:jobs! schedule (cons job (schedule:jobs schedule)))
+  (set-schedule:job-count! schedule (+ (schedule:job-count schedule) 1))
+  (if (not (schedule:heap-index schedule))
+      (heap-insert! schedule)))
+
+
+;; Detach the job from its schedule. If this leaves the schedule empty, it is
+;; taken out of the heap and forgotten. The job's record goes once the job has
+;; finished with it.
+
+(define (remove-job! job)
+  (let ((schedule (job:schedule job)))
+    (if schedule
+        (begin
+          (set-job:schedule! job #f)
+          (forget-job-if-idle! job)
+          (set-schedule:job-count! schedule
+                                   (- (schedule:job-count schedule) 1))
+          (if (<= (schedule:job-count schedule) 0)
+              (begin
+                (heap-remove! schedule)
+                (set-schedule:jobs! schedule '())
+                (if (eq? (hash-ref schedule-table (schedule:key schedule))
+                         schedule)
+                    (hash-remove! schedule-table (schedule:key schedule)))))))))
+
+
+
+;; Remove all the jobs belonging to this user from the user job table.
 
 (define (remove-user-jobs user)
   (if (or (string? user)
           (integer? user))
       (set! user (getpw user)))
-    (set! user-job-list
-          (remove (lambda (job) (eqv? (passwd:uid user)
-                                      (passwd:uid (job:user job))))
-                  user-job-list)))
+  (for-each remove-job! (hash-ref user-job-table (passwd:uid user) '()))
+  (hash-remove! user-job-table (passwd:uid user)))
 
 
 
 ;; Remove all the jobs on the system job list.
 
-(define (clear-system-jobs) (set! system-job-list '()))
+(define (clear-system-jobs)
+  (for-each remove-job! system-job-list)
+  (set! system-job-list '()))
+
+
+
+;; When a user's crontab is re-read, most of the lines in it will usually be
+;; the same as before. Rather than throw all the user's jobs away and make new
+;; ones, we set the old jobs aside in the table below while the new crontab is
+;; being read, indexed by an identity made up of everything which determines
+;; how and when a job runs. Whenever add-job is asked to make a job which has
+;; the same identity as one in this table, it puts the old job back instead, so
+;; keeping its schedule and next time. Jobs which are still in the table when
+;; the crontab has been read came from lines which have been removed, and are
+;; dropped. Only jobs which have a schedule key can be matched like this.
+
+(define reload-uid #f)
+(define reload-table #f)
+
+
+;; As the users, environments and strings are interned, the identity is made of
+;; their numbers in the intern tables, which stay the same as long as the old
+;; jobs are holding on to them.
+
+(define (make-job-identity schedule-key user-id environment-id displayable-id
+                           command-id overlap spread catch-up catch-up-limit)
+  (list schedule-key user-id environment-id displayable-id command-id
+        overlap spread catch-up catch-up-limit))
+
+(define (job-identity job schedule-key)
+  (make-job-identity schedule-key
+                     (job-field job 0)
+                     (job-field job 4)
+                     (job-field job 8)
+                     (job-field job 12)
+                     (job:overlap job)
+                     (job:spread job)
+                     (job:catch-up job)
+                     (job:catch-up-limit job)))
+
+
+;; If there is an old job with the given identity (#f if the new job has none)
+;; which can stand in for a new one of the user's, take it out of the
+;; reload-table and return it, otherwise return #f.
+
+(define (reclaim-old-job identity user)
+  (and reload-table
+       identity
+       (eq? configuration-source 'user)
+       (eqv? (passwd:uid user) reload-uid)
+       (let ((old-jobs (hash-ref reload-table identity '())))
+         (and (not (null? old-jobs))
+              (begin
+                (hash-set! reload-table identity (cdr old-jobs))
+                (car old-jobs))))))
+
+
+;; Replace all the jobs belonging to the user with the ones that the thunk adds
+;; (usually by reading the user's crontab), leaving the jobs which have not
+;; changed untouched. If the thunk does not finish (because of an error in the
+;; crontab, say), the jobs it has added are dropped again and the user keeps the
+;; old ones (all but those without a schedule key, which cannot be matched up
+;; and are always replaced).
+
+(define (reload-user-jobs user thunk)
+  (if (or (string? user)
+          (integer? user))
+      (set! user (getpw user)))
+  (let ((uid (passwd:uid user))
+        (old-jobs '())
+        (finished #f))
+    (dynamic-wind
+        (lambda ()
+          (set! reload-uid uid)
+          (set! reload-table (make-hash-table))
+          (set! old-jobs '())
+          (for-each (lambda (job)
+                      (let ((key (schedule:key (job:schedule job))))
+                        (if key
+                            (let ((identity (job-identity job key)))
+                              (set! old-jobs (cons job old-jobs))
+                              (hash-set! reload-table
+                                         identity
+                                         (cons job
+                                               (hash-ref reload-table
+                                                         identity
+                                                         '()))))
+                            (remove-job! job))))
+                    (hash-ref user-job-table uid '()))
+          (hash-remove! user-job-table uid))
+        (lambda ()
+          (thunk)
+          (set! finished #t))
+        (lambda ()
+          (if finished
+              (hash-for-each (lambda (identity old-jobs)
+                               (for-each remove-job! old-jobs))
+                             reload-table)
+              (let ((kept (make-hash-table)))
+                (for-each (lambda (job) (hashq-set! kept job #t)) old-jobs)
+                (for-each (lambda (job)
+                            (if (not (hashq-ref kept job))
+                                (remove-job! job)))
+                          (hash-ref user-job-table uid '()))
+                (if (null? old-jobs)
+                    (hash-remove! user-job-table uid)
+                    (hash-set! user-job-table uid (reverse old-jobs)))))
+          (set! reload-uid #f)
+          (set! reload-table #f)))))
+
+
+
+;; Where the host provides them (see mcron.c), these make and start the job
+;; launchers for shell command jobs.
+
+(define native-make-job-launcher
+  (and=> (module-variable the-root-module 'c-make-job-launcher) variable-ref))
+
+(define native-launch-job
+  (and=> (module-variable the-root-module 'c-launch-job) variable-ref))
+
+(define (make-job-launcher command environment user)
+  (and command
+       native-make-job-launcher
+       (native-make-job-launcher command
+                                 (environment-strings environment user)
+                                 (passwd:uid user)
+                                 (passwd:gid user)
+                                 (passwd:dir user))))
 
 
 
 ;; Add a new job with the given specifications to the head of the appropriate
-;; jobs list.
-
-(define (add-job time-proc action displayable configuration-time
-                 configuration-user)
-  (let ((entry (vector configuration-user
-                       time-proc
-                       action
-                       (get-current-environment-mods-copy)
-                       displayable
-                       (time-proc configuration-time))))
+;; jobs list, and put it in a schedule. If a schedule-key is given, it must be a
+;; canonical representation of the time-proc: any other job with the same key
+;; is taken to run at exactly the same times as this one. If a command is
+;; given, the action must do nothing but run that string with the shell, so that
+;; the job may be started directly with /bin/sh -c. The overlap policy is one of
+;; the symbols run, skip or queue, and the spread is a number of seconds (see
+;; the dispatch stage below). The catch-up policy, one of the symbols none, once
+;; or all, and the catch-up limit say what is to be done about the runs the job
+;; misses while the daemon is not running (see the run journal below).
+;;
+;; The user, environment, displayable and command are interned first; if an old
+;; job can be put back instead of making a new one, it already holds references
+;; to all of them, and the new ones are let go.
+
+(define* (add-job time-proc action displayable configuration-time
+                  configuration-user #:key (schedule-key #f) (command #f)
+                  (overlap 'run) (spread 0) (catch-up 'none)
+                  (catch-up-limit 10))
+  (let* ((environment (get-current-environment-mods-copy))
+         (user-id (intern! user-table configuration-user))
+         (environment-id (intern! environment-table environment))
+         (displayable-id (intern! string-table displayable))
+         (command-id (if command (intern! string-table command) no-number))
+         (entry (reclaim-old-job (and schedule-key
+                                      (make-job-identity schedule-key
+                                                         user-id
+                                                         environment-id
+                                                         displayable-id
+                                                         command-id
+                                                         overlap
+                                                         spread
+                                                         catch-up
+                                                         catch-up-limit))
+                                 configuration-user)))
+    (if entry
+        (begin
+          (release! user-table user-id)
+          (release! environment-table environment-id)
+          (release! string-table displayable-id)
+          (if command (release! string-table command-id)))
+        (let ((schedule (find-schedule schedule-key
+                                       time-proc
+                                       configuration-time))
+              (launcher-id
+               (if command
+                   (intern! launcher-table
+                            (list command-id environment-id user-id)
+                            (lambda ()
+                              (make-job-launcher command
+                                                 environment
+                                                 configuration-user)))
+                   no-number)))
+          (set! entry (make-job schedule
+                                (and (not command) action)
+                                user-id
+                                environment-id
+                                displayable-id
+                                command-id
+                                launcher-id
+                                overlap
+                                spread
+                                catch-up
+                                catch-up-limit))
+          (schedule-add-job! schedule entry)
+          (if journal (journal-baseline! entry configuration-time))))
     (if (eq? configuration-source 'user)
-      (set! user-job-list (cons entry user-job-list))
-      (set! system-job-list (cons entry system-job-list)))))
-
-
-
-;; Procedure to locate the jobs in the global job-list with the lowest
-;; (soonest) next-times. These are the jobs for which we must schedule the mcron
-;; program (under any personality) to next wake up. The return value is a cons
-;; cell consisting of the next time (maintained in the next-time variable) and a
-;; list of the job entries that are to run at this time (maintained in the
-;; next-jobs-list variable).
-;;
-;; The procedure works by first obtaining the time of the first job on the list,
-;; and setting this job in the next-jobs-list. Then for each other entry on the
-;; job-list, either the job runs earlier than any other that have been scanned,
-;; in which case the next-time and next-jobs-list are re-initialized to
-;; accomodate, or the job runs at the same time as the next job, in which case
-;; the next-jobs-list is simply augmented with the new job, or else the job runs
-;; later than others noted in which case we ignore it for now and continue to
-;; recurse the list.
-
-(define (find-next-jobs)
-  (let ((job-list (append system-job-list user-job-list)))
-    
-    (if (null? job-list)
-        
-        '(#f . '())
-        
-        (let ((next-time 2000000000)
-              (next-jobs-list '()))
-
-          (for-each
-           (lambda (job)
-             (let ((this-time (job:next-time job)))
-               (cond ((< this-time next-time)
-                          (set! next-time this-time)
-                          (set! next-jobs-list (list job)))
-                     ((eqv? this-time next-time)
-                          (set! next-jobs-list (cons job next-jobs-list))))))
-           job-list)
-
-          (cons next-time next-jobs-list)))))
-
-
-
-;; Create a string containing a textual list of the next count jobs to run.
-;;
-;; Enter a loop of displaying the next set of jobs to run, artificially
-;; forwarding the time to the next time point (instead of waiting for it to
-;; occur as we would do in a normal run of mcron), and recurse around the loop
-;; count times.
-;;
-;; Note that this has the effect of mutating the job timings. Thus the program
-;; must exit after calling this function; the internal data state will be left
-;; unusable.
-
-(define (get-schedule count)
+        (let ((uid (passwd:uid configuration-user)))
+          (hash-set! user-job-table
+                     uid
+                     (cons entry (hash-ref user-job-table uid '()))))
+        (set! system-job-list (cons entry system-job-list)))))
+
+
+
+;; Procedure to locate the schedules in the heap with the lowest (soonest)
+;; next-times. These are the jobs for which we must schedule the mcron program
+;; (under any personality) to next wake up. The return value is a cons cell
+;; consisting of the next time and a list of the schedules that are to run at
+;; this time.
+;;
+;; The soonest time is the one at the root of the heap. The schedules which
+;; share this time form a sub-tree hanging from the root (a schedule can only
+;; have the root's time if its parent does too), so we collect them by walking
+;; down the heap and not descending below any schedule which runs later. The
+;; cost is thus proportional to the number of schedules which are due, not to
+;; the size of the job table.
+
+(define (find-next-schedules)
+  (if (or (eqv? schedule-heap-size 0)
+          (eqv? (heap-time 0) never-time))
+
+      (cons #f '())
+
+      (let ((next-time (heap-time 0)))
+        (cons next-time
+              (let collect ((index 0) (next-schedules '()))
+                (if (or (>= index schedule-heap-size)
+                        (not (eqv? (heap-time index) next-time)))
+                    next-schedules
+                    (collect (+ (* index 2) 2)
+                             (collect (+ (* index 2) 1)
+                                      (cons (vector-ref schedule-heap index)
+                                            next-schedules)))))))))
+
+
+
+;; Work out which jobs will run in the future, without disturbing the schedules
+;; in any way, so that this can be done at any time in a running daemon. Each
+;; schedule provides a stream of future times (its next-time, then the result
+;; of applying its next-time-function to that, and so on), and we merge these
+;; streams with a heap of cursors, one per schedule, each of which is
+;;
+;;  (vector time schedule jobs)
+;;
+;; where time is the next time in the stream, and jobs is the list of the
+;; schedule's jobs which are of interest. The cost is logarithmic in the number
+;; of schedules for each time produced.
+
+(define (cursor:time cursor)     (vector-ref cursor 0))
+(define (cursor:schedule cursor) (vector-ref cursor 1))
+(define (cursor:jobs cursor)     (vector-ref cursor 2))
+
+(define (cursor-sift-down! heap size index)
+  (let ((cursor (vector-ref heap index)))
+    (let loop ((index index))
+      (let* ((left (+ (* index 2) 1))
+             (right (+ left 1))
+             (smallest
+              (cond ((>= left size) #f)
+                    ((and (< right size)
+                          (< (cursor:time (vector-ref heap right))
+                             (cursor:time (vector-ref heap left))))
+                     right)
+                    (else left))))
+        (if (and smallest
+                 (< (cursor:time (vector-ref heap smallest))
+                    (cursor:time cursor)))
+            (begin
+              (vector-set! heap index (vector-ref heap smallest))
+              (loop smallest))
+            (vector-set! heap index cursor))))))
+
+
+
+;; Return a list of the times at which jobs will run, in order, each paired with
+;; the list of jobs which will run then:
+;;
+;;  ((time job ...) ...)
+;;
+;; At most count times are returned if count is not #f. If from is given only
+;; times at or after it are considered (otherwise we start from the current
+;; next-times), and if until is given only times before it. If user is a UID,
+;; only that user's jobs are considered. Either count or until must be given.
+
+(define* (job-forecast count #:key (from #f) (until #f) (user #f))
+  (let ((heap (make-vector (max schedule-heap-size 1) #f))
+        (size 0))
+
+    (do ((index 0 (+ index 1)))
+        ((>= index schedule-heap-size))
+      (let* ((schedule (vector-ref schedule-heap index))
+             (jobs (filter (lambda (job)
+                             (and (job:schedule job)
+                                  (or (not user)
+                                      (eqv? (passwd:uid (job:user job))
+                                            user))))
+                           (schedule:jobs schedule)))
+             (time (let ((next (schedule:next-time schedule)))
+                     (if (and from next (< next from))
+                         ((schedule:next-time-function schedule) (- from 1))
+                         next))))
+        (if (and (not (null? jobs))
+                 time
+                 (or (not until) (< time until)))
+            (begin
+              (vector-set! heap size (vector time schedule jobs))
+              (set! size (+ size 1))))))
+
+    (do ((index (- (quotient size 2) 1) (- index 1)))
+        ((< index 0))
+      (cursor-sift-down! heap size index))
+
+    (let loop ((count count) (forecast '()))
+      (if (or (eqv? size 0) (and count (<= count 0)))
+          (reverse! forecast)
+          (let ((time (cursor:time (vector-ref heap 0))))
+            ;; The jobs due at this time are gathered in reverse order.
+            (let collect ((jobs '()))
+              (if (and (> size 0)
+                       (eqv? (cursor:time (vector-ref heap 0)) time))
+                  (let* ((cursor (vector-ref heap 0))
+                         (next ((schedule:next-time-function
+                                 (cursor:schedule cursor))
+                                time)))
+                    (if (and next
+                             (> next time)
+                             (or (not until) (< next until)))
+                        (vector-set! cursor 0 next)
+                        (begin
+                          (set! size (- size 1))
+                          (vector-set! heap 0 (vector-ref heap size))
+                          (vector-set! heap size #f)))
+                    (if (> size 0) (cursor-sift-down! heap size 0))
+                    (collect (append-reverse (cursor:jobs cursor) jobs)))
+                  (loop (and count (- count 1))
+                        (cons (cons time (reverse! jobs)) forecast)))))))))
+
+
+
+;; Describe a job for the outside world, as a list
+;;
+;;  (user-name next-time running pending displayable runs status duration peak)
+;;
+;; where running is the number of instances of the job which are running now,
+;; pending is true if the job is waiting on the dispatch queue, and the rest are
+;; the job's statistics (see below).
+
+(define (job-details job)
+  (list (passwd:name (job:user job))
+        (and=> (job:schedule job) schedule:next-time)
+        (job:running job)
+        (job:pending job)
+        (job:displayable job)
+        (job:runs job)
+        (job:status job)
+        (job:duration job)
+        (job:peak job)))
+
+
+;; Return the details of all the jobs in the system, or just those of the user
+;; with the given UID.
+
+(define* (job-status #:key (user #f))
+  (filter-map (lambda (job)
+                (and (job:schedule job)
+                     (or (not user)
+                         (eqv? (passwd:uid (job:user job)) user))
+                     (job-details job)))
+              (hash-fold (lambda (uid jobs all) (append jobs all))
+                         system-job-list
+                         user-job-table)))
+
+
+
+;; Create a string containing a textual list of the jobs which will run at the
+;; next count times (and/or in the given window of time, and for the given user;
+;; see job-forecast above).
+
+(define* (get-schedule count #:key (from #f) (until #f) (user #f))
   (with-output-to-string
     (lambda ()
-      (do ((count count (- count 1)))
-          ((eqv? count 0))
-        (and-let* ((next-jobs (find-next-jobs))
-                   (time (car next-jobs))
-                   (date-string (strftime "%c %z\n" (localtime time))))
-          (for-each (lambda (job)
-                      (display date-string)
-                      (display (job:displayable job))
-                      (newline)(newline)
-                      (vector-set! job
-                                   5
-                                   ((job:next-time-function job)
-                                                          (job:next-time job))))
-                    (cdr next-jobs)))))))
+      (for-each (lambda (time-jobs)
+                  (let ((date-string (strftime "%c %z\n"
+                                               (localtime (car time-jobs)))))
+                    (for-each (lambda (job)
+                                (display date-string)
+                                (display (job:displayable job))
+                                (newline)(newline))
+                              (cdr time-jobs))))
+                (job-forecast count #:from from #:until until #:user user)))))
 
 
 
@@ -187,40 +1016,745 @@
 
 
 
-;; For every job on the list, fork a process to run it (noting the fact by
-;; increasing the number-children counter), and in the new process set up the
-;; run-time environment exactly as it should be before running the job proper.
+;; Fork a process to run the job, and in the new process set up the run-time
+;; environment exactly as it should be before running the job proper. If
+;; output is given, it is the file descriptor the job's standard output and
+;; standard error are to go to (see below). Returns the PID of the new process.
+
+(define (fork-job job output)
+  (let ((pid (primitive-fork)))
+    (if (eqv? pid 0)
+        (begin
+          (if output
+              (begin
+                (dup2 output 1)
+                (dup2 output 2)))
+          (setgid (passwd:gid (job:user job)))
+          (setuid (passwd:uid (job:user job)))
+          (chdir (passwd:dir (job:user job)))
+          (modify-environment (job:environment job)
+                              (job:user job))
+          ((job:action job))
+          (force-output (current-output-port))
+          (force-output (current-error-port))
+          (primitive-exit 0)))
+    pid))
+
+
+
+;; Where the host provides them (see mcron.c), these capture the output of the
+;; jobs through pipes which are drained by the native event loop.
+
+(define native-open-job-output
+  (and=> (module-variable the-root-module 'c-open-job-output) variable-ref))
+
+(define native-attach-job-output
+  (and=> (module-variable the-root-module 'c-attach-job-output) variable-ref))
+
+(define native-take-job-output
+  (and=> (module-variable the-root-module 'c-take-job-output) variable-ref))
+
+
+
+;; Once set-job-output! has been called (the cron daemon does this), the output
+;; of every job is captured; until then, or if the host cannot do it, the jobs
+;; simply share our own standard output and error. The settings are kept in
+;;
+;;  (vector log-directory buffer-size log-size log-files mail-interval sendmail)
+;;
+;; where log-directory is where each job's output is logged (#f for no logs),
+;; log-size is the size at which a log is rotated and log-files the number of
+;; old logs kept, buffer-size is the number of bytes at the end of the output
+;; of each run which are kept to be mailed, and the mail which has built up is
+;; sent every mail-interval seconds with the sendmail command (a shell command
+;; which reads a message, with its recipients in the headers, on its standard
+;; input).
+
+(define job-output #f)
+(define mail-housekeeping #f)
+
+(define* (set-job-output! #:key (log-directory #f)
+                                (buffer-size 65536)
+                                (log-size 1048576)
+                                (log-files 3)
+                                (mail-interval 300)
+                                (sendmail "/usr/sbin/sendmail -oi -t"))
+  (if native-open-job-output
+      (begin
+        (if (and log-directory (not (file-exists? log-directory)))
+            (false-if-exception (mkdir log-directory #o750)))
+        (set! job-output (vector log-directory buffer-size log-size log-files
+                                 mail-interval sendmail))
+        (if mail-housekeeping
+            (vector-set! mail-housekeeping 0 mail-interval)
+            (set! mail-housekeeping
+                  (add-housekeeping! mail-interval send-job-mail))))))
+
+
+;; The log of a job is named after its user and a hash of its displayable, so
+;; that it is the same every time the job runs.
+
+(define (job-log-file job)
+  (and-let* ((directory (vector-ref job-output 0)))
+            (string-append directory "/" (passwd:name (job:user job)) "."
+                           (number->string (string-hash (job:displayable job)
+                                                        #x7fffffff)
+                                           16)
+                           ".log")))
+
+
+;; The output of a job is mailed to the address in the MAILTO variable of its
+;; environment, or to its user if there is no such variable. If MAILTO is set to
+;; nothing, no mail is sent and we return #f.
+
+(define (job-mail-address job)
+  (let ((mail-to (fold (lambda (variable found)
+                         (if (string=? (car variable) "MAILTO") variable found))
+                       #f
+                       (job:environment job))))
+    (cond ((not mail-to) (passwd:name (job:user job)))
+          ((or (not (cdr mail-to)) (string-null? (cdr mail-to))) #f)
+          (else (cdr mail-to)))))
+
+
+;; Return the file descriptor which the job about to be started should write its
+;; output to, or #f if it is not to be captured. Nothing is kept in memory for
+;; a job whose output is not to be mailed.
+
+(define (open-job-output job)
+  (and job-output
+       (native-open-job-output (job-log-file job)
+                               (if (job-mail-address job)
+                                   (vector-ref job-output 1)
+                                   0)
+                               (vector-ref job-output 2)
+                               (vector-ref job-output 3))))
+
+
+
+;; The output of the jobs which have finished since the mail was last sent is
+;; held in the mail-queue, a hash table from each recipient to a list (latest
+;; first) of
+;;
+;;  (vector user-name displayable time status output dropped)
+;;
+;; where output is a bytevector holding the end of the job's output and dropped
+;; is the number of bytes which came before it. Every mail-interval seconds all
+;; the output for each recipient goes in a single message; if the queue comes to
+;; hold sixteen jobs' worth of output it is sent straight away, so that it can
+;; never grow very big however many jobs there are.
+
+(define mail-queue (make-hash-table))
+(define mail-queue-size 0)
+
+
+(define (queue-job-mail job pid status)
+  (and-let* ((output (native-take-job-output pid))
+             (mail-to (job-mail-address job)))
+            (hash-set! mail-queue mail-to
+                       (cons (vector (passwd:name (job:user job))
+                                     (job:displayable job)
+                                     (current-time)
+                                     status
+                                     (car output)
+                                     (cdr output))
+                             (hash-ref mail-queue mail-to '())))
+            (set! mail-queue-size (+ mail-queue-size
+                                     (bytevector-length (car output))))
+            (if (>= mail-queue-size (* 16 (vector-ref job-output 1)))
+                (send-job-mail))))
+
+
+(define (one-line string)
+  (string-map (lambda (char) (if (char=? char #\newline) #\space char))
+              string))
+
+(define (job-mail-text mail-to entries)
+  (string-append "From: root (Cron Daemon)\n"
+                 "To: " (one-line mail-to) "\n"
+                 "Subject: Cron <"
+                 (if (null? (cdr entries))
+                     (string-append (vector-ref (car entries) 0)
+                                    "@" (gethostname) "> "
+                                    (one-line (vector-ref (car entries) 1)))
+                     (string-append (gethostname) "> output of "
+                                    (number->string (length entries))
+                                    " jobs"))
+                 "\n"
+                 "Auto-Submitted: auto-generated\n"
+                 "Precedence: bulk\n"))
+
+(define (job-mail-entry-text entry)
+  (let ((status (vector-ref entry 3))
+        (dropped (vector-ref entry 5)))
+    (string-append "\n--- " (one-line (vector-ref entry 1)) "\n"
+                   "    run for " (vector-ref entry 0) ", finished "
+                   (strftime "%c" (localtime (vector-ref entry 2))) ", "
+                   (if (status:term-sig status)
+                       (string-append "killed by signal "
+                                      (number->string (status:term-sig status)))
+                       (string-append "exit status "
+                                      (number->string
+                                       (status:exit-val status))))
+                   "\n"
+                   (if (> dropped 0)
+                       (string-append "    (the first " (number->string dropped)
+                                      " bytes of output are not shown)\n")
+                       "")
+                   "\n")))
+
+
+;; The string in single quotes for the shell, whatever characters are in it.
+
+(define (shell-quote string)
+  (string-append "'"
+                 (apply string-append
+                        (map (lambda (char)
+                               (if (char=? char #\')
+                                   "'\\''"
+                                   (string char)))
+                             (string->list string)))
+                 "'"))
+
+
+;; Write the message to a temporary file and start the sendmail command on it
+;; (the command removes the file when it is done), without waiting for it to
+;; finish. The message cannot be sent if anything goes wrong, and it is not
+;; worth stopping the daemon for.
+
+(define (send-mail-message mail-to entries)
+  (let ((file-name (string-copy (string-append (or (getenv "TMPDIR") "/tmp")
+                                               "/mcron-mail.XXXXXX"))))
+    (catch #t
+           (lambda ()
+             (let ((port (mkstemp! file-name)))
+               (put-bytevector port (string->utf8 (job-mail-text mail-to
+                                                                 entries)))
+               (for-each (lambda (entry)
+                           (let ((output (vector-ref entry 4)))
+                             (put-bytevector port (string->utf8
+                                                   (job-mail-entry-text entry)))
+                             (put-bytevector port output)
+                             (if (not (eqv? (bytevector-u8-ref
+                                             output
+                                             (- (bytevector-length output) 1))
+                                            10))
+                                 (put-bytevector port (string->utf8 "\n")))))
+                         entries)
+               (close-port port))
+             (if (not (and=> (native-make-job-launcher
+                              (string-append (vector-ref job-output 5)
+                                             " < " (shell-quote file-name)
+                                             "; rm -f " (shell-quote file-name))
+                              (environ) 0 0 "/")
+                             native-launch-job))
+                 (delete-file file-name)))
+           (lambda (key . args)
+             (false-if-exception (delete-file file-name))))))
+
+
+(define (send-job-mail)
+  (hash-for-each (lambda (mail-to entries)
+                   (send-mail-message mail-to (reverse entries)))
+                 mail-queue)
+  (hash-clear! mail-queue)
+  (set! mail-queue-size 0))
+
+
+
+;; Jobs which have come due are not started straight away, but go through a
+;; dispatch stage which can hold them back. The dispatch-queue holds the jobs
+;; waiting to start, in the order in which they came due, as pairs of the
+;; earliest time the job may start and the job itself. A job is started when
+;; that time has come, the total number of running jobs is below
+;; max-running-jobs, the number of its user's running jobs is below
+;; max-running-user-jobs (either limit may be #f for no limit), and, unless its
+;; overlap policy is run, no other instance of the job is running.
+;;
+;; The running-jobs table maps the PIDs of the children to the jobs they are
+;; running, and the user-running-counts table holds the number of running jobs
+;; of each UID.
+
+(define max-running-jobs #f)
+(define max-running-user-jobs #f)
+
+(define dispatch-queue '())
+(define running-jobs (make-hash-table))
+(define user-running-counts (make-hash-table))
+
+
+(define* (set-job-limits! #:key (total max-running-jobs)
+                                (per-user max-running-user-jobs))
+  (set! max-running-jobs total)
+  (set! max-running-user-jobs per-user))
+
+
+
+;; A job with a spread of n seconds starts up to n seconds after it comes due,
+;; at an offset which is derived from its user and displayable, so that it is
+;; the same every time the job runs (and every time mcron is restarted), but
+;; different jobs due at the same time are spread evenly across the window.
+
+(define (job-start-offset job)
+  (if (> (job:spread job) 0)
+      (string-hash (string-append (passwd:name (job:user job))
+                                  ":"
+                                  (job:displayable job))
+                   (+ (job:spread job) 1))
+      0))
+
+
+
+;; Return a dispatch queue entry for the job which came due at the given time,
+;; or #f if its overlap policy says it is not to run this time: a skip job is
+;; dropped if an instance is already running, and neither a skip nor a queue job
+;; is queued twice.
+
+(define (queue-entry job due-time)
+  (case (job:overlap job)
+    ((skip)  (and (not (job:pending job))
+                  (eqv? (job:running job) 0)
+                  (begin (set-job:pending! job #t)
+                         (cons (+ due-time (job-start-offset job)) job))))
+    ((queue) (and (not (job:pending job))
+                  (begin (set-job:pending! job #t)
+                         (cons (+ due-time (job-start-offset job)) job))))
+    (else    (cons (+ due-time (job-start-offset job)) job))))
+
+
+
+;; The measurements of the jobs. Besides these totals for the whole system, each
+;; job keeps its own statistics in its record: runs is the number of times it
+;; has finished running, status and duration are the exit status (as from
+;; waitpid) and running time in seconds of the last run (#f if there has not
+;; been one), and peak is the greatest number of instances of the job which
+;; have been running at once.
+
+(define latency-buckets '(0.01 0.1 0.5 1 2 5 10 30 60 300))
+
+(define wakeups-metric
+  (define-counter "mcron_wakeups_total"
+    "Times the main loop has woken up to run jobs."))
+
+(define wake-lateness-metric
+  (define-histogram "mcron_wake_lateness_seconds"
+    "How long after the jobs were due the main loop woke up to run them."
+    latency-buckets))
+
+(define start-delay-metric
+  (define-histogram "mcron_job_start_delay_seconds"
+    "How long after it was due (allowing for its spread) each job started."
+    latency-buckets))
+
+(define spawn-metric
+  (define-histogram "mcron_job_spawn_seconds"
+    "Time taken to start the process for each job."
+    fast-buckets))
+
+(define duration-metric
+  (define-histogram "mcron_job_duration_seconds"
+    "Time for which the process of each job ran."
+    '(1 5 10 30 60 300 900 3600 14400)))
+
+(define skipped-metric
+  (define-counter "mcron_jobs_skipped_total"
+    "Jobs not run because an earlier instance was still running or queued."))
+
+(define caught-up-metric
+  (define-counter "mcron_jobs_caught_up_total"
+    "Runs missed while the daemon was not running which were made up."))
+
+(define started-metric
+  (define-counter "mcron_jobs_started_total"
+    "Job processes started."))
+
+(define finished-metrics
+  (map (lambda (outcome)
+         (cons outcome
+               (define-counter "mcron_jobs_finished_total"
+                 "Job processes finished, by how they ended."
+                 #:labels (string-append "outcome=\"" outcome "\""))))
+       '("success" "failure" "signal")))
+
+(define running-metric
+  (define-gauge "mcron_running_jobs"
+    "Job processes running now."
+    #:thunk (lambda () number-children)))
+
+(define running-peak-metric
+  (define-gauge "mcron_running_jobs_peak"
+    "The greatest number of job processes which have been running at once."))
+
+(define queued-metric
+  (define-gauge "mcron_queued_jobs"
+    "Jobs which have come due but not yet been started."
+    #:thunk (lambda () (length dispatch-queue))))
+
+(define schedules-metric
+  (define-gauge "mcron_schedules"
+    "Distinct schedules of the jobs in the system."
+    #:thunk (lambda () schedule-heap-size)))
+
+(define jobs-metric
+  (define-gauge "mcron_job_records"
+    "Records in use in the job table."
+    #:thunk (lambda () live-job-count)))
+
+(define environments-metric
+  (define-gauge "mcron_job_environments"
+    "Distinct environments of the jobs in the system."
+    #:thunk (lambda () (- (intern-table:size environment-table)
+                          (length (intern-table:free environment-table))))))
+
+
+
+;; Start a process to run the job, noting the fact in the running-jobs table
+;; (along with the time it started) and the counters. Shell command jobs with a
+;; launcher are started directly; all others, and any the launcher fails on, are
+;; forked. The job was due to start at not-before. If the output of the jobs is
+;; being captured, the job's goes down a new pipe.
+
+(define (start-job job not-before)
+  (let* ((start (metrics-clock))
+         (output (open-job-output job))
+         (pid (or (and=> (job:launcher job)
+                         (lambda (launcher) (native-launch-job launcher output)))
+                  (fork-job job output)))
+         (started (metrics-clock))
+         (uid (passwd:uid (job:user job))))
+    (if output (native-attach-job-output output pid))
+    (hash-set! running-jobs pid (cons job started))
+    (hash-set! user-running-counts uid
+               (+ (hash-ref user-running-counts uid 0) 1))
+    (set-job:running! job (+ (job:running job) 1))
+    (set-job:pending! job #f)
+    (set! number-children (+ number-children 1))
+    (observe! spawn-metric (- started start))
+    (observe! start-delay-metric (max 0 (- start not-before)))
+    (counter-add! started-metric 1)
+    (gauge-max! running-peak-metric number-children)
+    (if (> (job:running job) (job:peak job))
+        (set-job:peak! job (job:running job)))
+    (if journal
+        (journal-record! job (- not-before (job-start-offset job)) start))))
+
+
+
+;; Undo the above when the child process with the given PID has died with the
+;; given status, note how it went, and queue any output it had for the mail.
+
+(define (job-finished! pid status)
+  (let ((entry (hash-ref running-jobs pid)))
+    (if entry
+        (let* ((job (car entry))
+               (duration (- (metrics-clock) (cdr entry)))
+               (uid (passwd:uid (job:user job)))
+               (count (- (hash-ref user-running-counts uid 1) 1)))
+          (hash-remove! running-jobs pid)
+          (if (> count 0)
+              (hash-set! user-running-counts uid count)
+              (hash-remove! user-running-counts uid))
+          (set-job:running! job (- (job:running job) 1))
+          (set! number-children (- number-children 1))
+          (observe! duration-metric duration)
+          (counter-add! (assoc-ref finished-metrics
+                                   (cond ((status:term-sig status) "signal")
+                                         ((eqv? (status:exit-val status) 0)
+                                          "success")
+                                         (else "failure")))
+                        1)
+          (set-job:outcome! job status duration)
+          (if job-output (queue-job-mail job pid status))
+          (forget-job-if-idle! job)))))
+
+
+
+;; Start as many of the jobs in the dispatch queue as we can at the given time,
+;; in first-come-first-served order. Jobs which have been removed from the
+;; system since they came due are dropped.
+
+(define (job-may-start? job)
+  (and (or (eq? (job:overlap job) 'run)
+           (eqv? (job:running job) 0))
+       (or (not max-running-user-jobs)
+           (< (hash-ref user-running-counts (passwd:uid (job:user job)) 0)
+              max-running-user-jobs))))
+
+(define (dispatch-jobs now)
+  (let loop ((queue dispatch-queue) (waiting '()))
+    (cond ((null? queue)
+           (set! dispatch-queue (reverse! waiting)))
+          ((and max-running-jobs (>= number-children max-running-jobs))
+           (set! dispatch-queue (append! (reverse! waiting) queue)))
+          ((not (job:schedule (cdar queue)))
+           (if (not (job-forgotten? (cdar queue)))
+               (begin
+                 (set-job:pending! (cdar queue) #f)
+                 (forget-job-if-idle! (cdar queue))))
+           (loop (cdr queue) waiting))
+          ((and (<= (caar queue) now) (job-may-start? (cdar queue)))
+           (start-job (cdar queue) (caar queue))
+           (loop (cdr queue) waiting))
+          (else
+           (loop (cdr queue) (cons (car queue) waiting))))))
+
+
+
+;; The time at which the main loop must next wake up: the next-time of the
+;; soonest schedule, or the start time of a spread job if that is sooner. Jobs
+;; which are only being held back by the limits are started when a child dies.
+
+(define (next-wake-time next-time now)
+  (fold (lambda (entry wake-time)
+          (if (and (> (car entry) now)
+                   (or (not wake-time) (< (car entry) wake-time)))
+              (car entry)
+              wake-time))
+        next-time
+        dispatch-queue))
+
+
+
+;; Put every job in the schedules on the dispatch queue (subject to its overlap
+;; policy), and start any which may run now.
+;;
+;; Once all the jobs of a schedule have been queued, update the schedule by
+;; computing the next time its jobs need to run.
+
+(define (run-jobs schedule-list)
+  (let ((entries '()))
+    (for-each
+     (lambda (schedule)
+       (for-each (lambda (job)
+                   (let ((entry (queue-entry job (schedule:next-time schedule))))
+                     (if entry
+                         (set! entries (cons entry entries))
+                         (begin
+                           (counter-add! skipped-metric 1)
+                           (if journal
+                               (journal-record! job
+                                                (schedule:next-time schedule)
+                                                0))))))
+                 (schedule:live-jobs schedule))
+       (advance-schedule! schedule (current-time)))
+     schedule-list)
+    (set! dispatch-queue (append! dispatch-queue (reverse! entries)))
+    (dispatch-jobs (current-time))))
+
+
+
+;; Where the host provides them (see mcron.c), these keep the run journal.
+
+(define native-open-journal
+  (and=> (module-variable the-root-module 'c-open-journal) variable-ref))
+
+(define native-journal-record
+  (and=> (module-variable the-root-module 'c-journal-record) variable-ref))
+
+(define native-journal-sync
+  (and=> (module-variable the-root-module 'c-journal-sync) variable-ref))
+
+(define native-journal-last-run
+  (and=> (module-variable the-root-module 'c-journal-last-run) variable-ref))
+
+(define native-journal-mark
+  (and=> (module-variable the-root-module 'c-journal-mark) variable-ref))
+
+(define native-journal-compact
+  (and=> (module-variable the-root-module 'c-journal-compact) variable-ref))
+
+
+
+;; Once set-job-journal! has been called (the cron daemon does this), every
+;; time a job is started, or skipped by its overlap policy, the time it was due
+;; and the time it started (0 if it did not) are added to the run journal, and
+;; so is the time at which a job with a catch-up policy was first seen. When the
+;; daemon starts again, catch-up-jobs looks in the journal for the last time
+;; each such job was due, and makes up the runs it has missed since: none, once
+;; (however many were missed) or all of them, up to the job's catch-up limit.
+;; The made-up runs are started straight away, subject to the overlap policies
+;; and limits like any others.
+;;
+;; The journal is written in batches and synced every sync-interval seconds,
+;; and when it holds more than compact-records records it is compacted, keeping
+;; only the latest record of each job still in the system. The settings are
+;; kept in
 ;;
-;; In the parent, update the job entry by computing the next time the job needs
-;; to run.
+;;  (vector sync-interval compact-records)
+;;
+;; A job is known in the journal by its user, time specification and
+;; displayable, which are the same every time the daemon reads its crontab.
+
+(define journal #f)
+(define journal-housekeeping #f)
+
+(define* (set-job-journal! #:key (directory #f)
+                                 (sync-interval 5)
+                                 (compact-records 1000000))
+  (if (and directory native-open-journal)
+      (begin
+        (if (not (file-exists? directory))
+            (false-if-exception (mkdir directory #o700)))
+        (if (native-open-journal directory)
+            (begin
+              (set! journal (vector sync-interval compact-records))
+              (if journal-housekeeping
+                  (vector-set! journal-housekeeping 0 sync-interval)
+                  (set! journal-housekeeping
+                        (add-housekeeping! sync-interval sync-job-journal))))
+            (set! journal #f)))
+      (set! journal #f)))
+
+
+(define (job-journal-key job)
+  (string-append (passwd:name (job:user job)) "\n"
+                 (or (schedule:key (job:schedule job)) "") "\n"
+                 (job:displayable job)))
+
+(define (journal-record! job scheduled started)
+  (native-journal-record (job-journal-key job)
+                         (inexact->exact (floor scheduled))
+                         (inexact->exact (floor started))))
+
+(define (journal-baseline! job time)
+  (if (and (not (eq? (job:catch-up job) 'none))
+           (not (native-journal-last-run (job-journal-key job))))
+      (journal-record! job time 0)))
 
-(define (run-jobs jobs-list)
-  (for-each (lambda (job)
-              (if (eqv? (primitive-fork) 0)
-                  (begin
-                    (setgid (passwd:gid (job:user job)))
-                    (setuid (passwd:uid (job:user job)))
-                    (chdir (passwd:dir (job:user job)))
-                    (modify-environment (job:environment job) (job:user job))
-                    ((job:action job))
-                    (primitive-exit 0))
-                  (begin
-                    (set! number-children (+ number-children 1))
-                    (vector-set! job
-                                 5
-                                 ((job:next-time-function job)
-                                                            (current-time))))))
-            jobs-list))
 
+(define (for-each-job proc)
+  (for-each proc system-job-list)
+  (hash-for-each (lambda (uid jobs) (for-each proc jobs)) user-job-table))
 
 
-;; Give any zombie children a chance to die, and decrease the number known to
+(define (sync-job-journal)
+  (if journal
+      (let ((records (native-journal-sync)))
+        (if (and records (> records (vector-ref journal 1)))
+            (begin
+              (for-each-job (lambda (job)
+                              (if (job:schedule job)
+                                  (native-journal-mark
+                                   (job-journal-key job)))))
+              (native-journal-compact))))))
+
+
+;; The number of runs the job has missed since it was last due at the time
+;; last, up to now, and up to its limit (one for a once job). Any times from
+;; its schedule's next-time on will be run in the ordinary way.
+
+(define (missed-runs job last now)
+  (let* ((schedule (job:schedule job))
+         (next-time-function (schedule:next-time-function schedule))
+         (until (min (+ now 1)
+                     (or (schedule:next-time schedule) (+ now 1))))
+         (limit (if (eq? (job:catch-up job) 'once)
+                    1
+                    (job:catch-up-limit job))))
+    (let loop ((time (next-time-function last)) (count 0))
+      (if (and time (> time last) (< time until) (< count limit))
+          (loop (next-time-function time) (+ count 1))
+          count))))
+
+
+(define (catch-up-jobs)
+  (if journal
+      (let ((now (current-time))
+            (entries '()))
+        (for-each-job
+         (lambda (job)
+           (if (and (job:schedule job)
+                    (not (eq? (job:catch-up job) 'none)))
+               (let ((last-run (native-journal-last-run
+                                (job-journal-key job))))
+                 (if last-run
+                     (do ((count (missed-runs job (car last-run) now)
+                                 (- count 1)))
+                         ((<= count 0))
+                       (let ((entry (queue-entry job now)))
+                         (if entry
+                             (begin
+                               (set! entries (cons entry entries))
+                               (counter-add! caught-up-metric 1)))))
+                     (journal-baseline! job now))))))
+        (set! dispatch-queue (append! dispatch-queue (reverse! entries)))
+        (dispatch-jobs now))))
+
+
+
+;; Give any zombie children a chance to die, and decrease the numbers known to
 ;; exist.
 
 (define (child-cleanup)
-  (do () ((or (<= number-children 0)
-	      (eqv? (car (waitpid WAIT_ANY WNOHANG)) 0)))
-    (set! number-children (- number-children 1))))
+  (let loop ()
+    (if (> number-children 0)
+        (let ((child (waitpid WAIT_ANY WNOHANG)))
+          (if (not (eqv? (car child) 0))
+              (begin
+                (job-finished! (car child) (cdr child))
+                (loop)))))))
+
+
+
+;; Some work has to be done from time to time whatever the jobs are doing
+;; (writing out the metrics, or sending the mail, for example). The main loop
+;; calls each thunk added with add-housekeeping! every interval seconds; the
+;; housekeeping list holds the tasks as
+;;
+;;  (vector interval thunk next-time)
+;;
+;; and add-housekeeping! returns the new one, so that its interval can be
+;; changed later. Run-housekeeping calls the thunks which are due, and returns
+;; the time at which the main loop must next wake up for them (or #f if there
+;; is nothing to do).
+
+(define housekeeping '())
+
+(define (add-housekeeping! interval thunk)
+  (let ((task (vector interval thunk 0)))
+    (set! housekeeping (append housekeeping (list task)))
+    task))
+
+(define (run-housekeeping now)
+  (fold (lambda (task wake-time)
+          (if (>= now (vector-ref task 2))
+              (begin
+                ((vector-ref task 1))
+                (vector-set! task 2 (+ now (vector-ref task 0)))))
+          (if (or (not wake-time) (< (vector-ref task 2) wake-time))
+              (vector-ref task 2)
+              wake-time))
+        #f
+        housekeeping))
+
+
+
+;; Where the host provides it (see mcron.c), the main loop waits for the next
+;; job time, dying children and ready file descriptors all at once with a
+;; native event loop. The procedure returns a pair: the list of the members of
+;; fd-list which are readable and of write-list which are writable, and a list
+;; of (pid . status) pairs for the children it has reaped.
+
+(define native-wait-for-events
+  (and=> (module-variable the-root-module 'c-wait-for-events) variable-ref))
+
+
+
+;; Otherwise we sleep in select until the next job is due or one of the file
+;; descriptors becomes ready, returning the list of those which are.
+
+(define (wait-with-select fd-list write-list sleep-time)
+  (catch 'system-error
+         (lambda ()
+           (let ((ready (select fd-list write-list '() sleep-time)))
+             (append (car ready) (cadr ready))))
+         (lambda (key . args) ;; Exception add by Sergey
+						                           ;; Poznyakoff.
+           (if (member (car (last args))
+                       (list EINTR EAGAIN))
+               (begin
+                 (child-cleanup) '())
+               (apply throw key args)))))
 
 
 
@@ -230,42 +1764,74 @@
 ;; completed. Repeat ad infinitum.
 ;;
 ;; Note that, if we wake ahead of time, it can only mean that a signal has been
-;; sent by a crontab job to tell us to re-read a crontab file. In this case we
-;; break out of the loop here, and let the main procedure deal with the
-;; situation (it will eventually re-call this function, thus maintaining the
-;; loop).
+;; sent by a crontab job to tell us to re-read a crontab file, or that the
+;; crontab files have changed. In this case we break out of the loop here,
+;; returning the list of file descriptors which are ready for reading, and let
+;; the main procedure deal with the situation (it will eventually re-call this
+;; function, thus maintaining the loop). A second, optional, list holds file
+;; descriptors which the caller has output waiting for; we break out in the
+;; same way when any of them becomes writable.
+;;
+;; With the native event loop, a child dying or the system clock being set also
+;; wakes us early; we simply account for the children and take another look at
+;; the clock, only running jobs when their time has really come.
 
-(define (run-job-loop . fd-list)
+(define (run-job-loop . fd-lists)
 
   (call-with-current-continuation
    (lambda (break)
      
-     (let ((fd-list (if (null? fd-list) '() (car fd-list))))
+     (let ((fd-list (if (null? fd-lists) '() (car fd-lists)))
+           (write-list (if (or (null? fd-lists) (null? (cdr fd-lists)))
+                           '()
+                           (cadr fd-lists))))
 
        (let loop ()
 
-         (let* ((next-jobs      (find-next-jobs))
-                (next-time      (car next-jobs))
-                (next-jobs-list (cdr next-jobs))
-                (sleep-time     (if next-time (- next-time (current-time))
-                                    2000000000)))
-
-           (and (> sleep-time 0)
-                (if (not (null?
-                          (catch 'system-error
-                                 (lambda ()
-                                   (car (select fd-list '() '() sleep-time)))
-                                 (lambda (key . args) ;; Exception add by Sergey
-						                              ;; Poznyakoff.
-                                   (if (member (car (last args))
-                                               (list EINTR EAGAIN))
-                                       (begin
-                                         (child-cleanup) '())
-                                       (apply throw key args))))))
-                    (break)))
-
-           (run-jobs next-jobs-list)
-
-           (child-cleanup)
+         (let* ((start          (metrics-clock))
+                (next-schedules (find-next-schedules))
+                (next-time      (car next-schedules))
+                (schedule-list  (cdr next-schedules))
+                (now            (current-time))
+                (housekeeping   (run-housekeeping now))
+                (wake-time      (let ((wake-time (next-wake-time next-time
+                                                                 now)))
+                                  (if (and housekeeping
+                                           (or (not wake-time)
+                                               (< housekeeping wake-time)))
+                                      housekeeping
+                                      wake-time))))
+
+           (observe! find-next-metric (- (metrics-clock) start))
+
+           (cond ((and next-time (<= next-time now))
+                  (counter-add! wakeups-metric 1)
+                  (observe! wake-lateness-metric (max 0 (- start next-time)))
+                  (run-jobs schedule-list)
+                  (child-cleanup))
+
+                 (native-wait-for-events
+                  (let ((events (native-wait-for-events wake-time
+                                                        fd-list
+                                                        write-list)))
+                    (for-each (lambda (child)
+                                (job-finished! (car child) (cdr child)))
+                              (cdr events))
+                    (dispatch-jobs (current-time))
+                    (if (not (null? (car events)))
+                        (break (car events)))))
+
+                 (else
+                  ;; We do not hear of children dying here, so if any jobs
+                  ;; are being held back we look again every second.
+                  (let ((ready (wait-with-select
+                                fd-list
+                                write-list
+                                (min (if wake-time (- wake-time now) 2000000000)
+                                     (if (null? dispatch-queue) 2000000000 1)))))
+                    (child-cleanup)
+                    (dispatch-jobs (current-time))
+                    (if (not (null? ready))
+                        (break ready)))))
            
            (loop)))))))
@@ -0,0 +1,207 @@
+;;   Copyright (C) 2026 Free Software Foundation, Inc.
+;;
+;;   This file is part of GNU mcron.
+;;
+;;   GNU mcron is free software: you can redistribute it and/or modify it under
+;;   the terms of the GNU General Public License as published by the Free
+;;   Software Foundation, either version 3 of the License, or (at your option)
+;;   any later version.
+;;
+;;   GNU mcron is distributed in the hope that it will be useful, but WITHOUT
+;;   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+;;   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+;;   more details.
+;;
+;;   You should have received a copy of the GNU General Public License along
+;;   with GNU mcron.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+;; This module keeps the measurements which tell an administrator how well the
+;; scheduler is doing: counters, gauges and histograms, which the core and the
+;; main program update as they go, and which can be rendered in the Prometheus
+;; text exposition format, either for the daemon's socket or for a file which
+;; is rewritten (atomically) from time to time for a collector to pick up.
+;;
+;; All times are measured with metrics-clock, in seconds since the epoch with a
+;; fractional part, so that they can be compared with the job times.
+
+
+
+
+(define-module (mcron metrics)
+  #:export (metrics-clock
+            define-counter
+            define-gauge
+            define-histogram
+            counter-add!
+            gauge-set!
+            gauge-max!
+            observe!
+            metrics-text
+            write-metrics-file))
+
+
+
+(define (metrics-clock)
+  (let ((time (gettimeofday)))
+    (+ (car time) (/ (cdr time) 1000000.))))
+
+
+
+;; Each metric is
+;;
+;;  (vector name labels type help value)
+;;
+;; where name is the Prometheus metric name, labels is a string such as
+;; outcome="success" (or #f), and type is one of the symbols counter, gauge or
+;; histogram. The value of a counter or gauge is a number, or, for a gauge, a
+;; thunk which returns the current value when the metrics are rendered. The
+;; value of a histogram is
+;;
+;;  (vector bounds counts sum count)
+;;
+;; where bounds is a vector of the upper bounds of the buckets, in increasing
+;; order, and counts a vector of the number of observations which fell in each
+;; (the cumulative counts Prometheus wants are worked out when rendering).
+;;
+;; The metrics are kept in the order in which they were defined, which is the
+;; order in which they are rendered; metrics which share a name (with different
+;; labels) must be defined one after the other.
+
+(define all-metrics '())
+
+(define (metric:name metric)   (vector-ref metric 0))
+(define (metric:labels metric) (vector-ref metric 1))
+(define (metric:type metric)   (vector-ref metric 2))
+(define (metric:help metric)   (vector-ref metric 3))
+(define (metric:value metric)  (vector-ref metric 4))
+
+(define (set-metric:value! metric value) (vector-set! metric 4 value))
+
+
+(define (define-metric name labels type help value)
+  (let ((metric (vector name labels type help value)))
+    (set! all-metrics (append all-metrics (list metric)))
+    metric))
+
+(define* (define-counter name help #:key (labels #f))
+  (define-metric name labels 'counter help 0))
+
+(define* (define-gauge name help #:key (labels #f) (thunk #f))
+  (define-metric name labels 'gauge help (or thunk 0)))
+
+(define* (define-histogram name help bounds #:key (labels #f))
+  (define-metric name labels 'histogram help
+    (vector (list->vector bounds)
+            (make-vector (+ (length bounds) 1) 0)
+            0
+            0)))
+
+
+(define (counter-add! metric amount)
+  (set-metric:value! metric (+ (metric:value metric) amount)))
+
+(define (gauge-set! metric value)
+  (set-metric:value! metric value))
+
+(define (gauge-max! metric value)
+  (if (> value (metric:value metric))
+      (set-metric:value! metric value)))
+
+
+;; Note the value in the first bucket whose bound it does not exceed (or the
+;; last, unbounded, one).
+
+(define (observe! metric value)
+  (let* ((histogram (metric:value metric))
+         (bounds (vector-ref histogram 0))
+         (counts (vector-ref histogram 1)))
+    (let loop ((index 0))
+      (if (and (< index (vector-length bounds))
+               (> value (vector-ref bounds index)))
+          (loop (+ index 1))
+          (vector-set! counts index (+ (vector-ref counts index) 1))))
+    (vector-set! histogram 2 (+ (vector-ref histogram 2) value))
+    (vector-set! histogram 3 (+ (vector-ref histogram 3) 1))))
+
+
+
+;; Render all the metrics in the Prometheus text format, returning a string.
+
+(define (number->text number)
+  (cond ((and (exact? number) (integer? number)) (number->string number))
+        ((integer? number) (number->string (inexact->exact number)))
+        (else (number->string (exact->inexact number)))))
+
+(define (display-sample name labels extra-label value)
+  (display name)
+  (if (or labels extra-label)
+      (begin
+        (display "{")
+        (display (string-join (filter string? (list labels extra-label))
+                              ","))
+        (display "}")))
+  (display " ")
+  (display (number->text value))
+  (newline))
+
+(define (metrics-text)
+  (with-output-to-string
+    (lambda ()
+      (let loop ((metrics all-metrics) (last-name #f))
+        (if (not (null? metrics))
+            (let* ((metric (car metrics))
+                   (name (metric:name metric))
+                   (labels (metric:labels metric))
+                   (value (metric:value metric)))
+              (if (not (equal? name last-name))
+                  (begin
+                    (display (string-append "# HELP " name " "
+                                            (metric:help metric) "\n"))
+                    (display (string-append "# TYPE " name " "
+                                            (symbol->string
+                                             (metric:type metric))
+                                            "\n"))))
+              (case (metric:type metric)
+                ((histogram)
+                 (let ((bounds (vector-ref value 0))
+                       (counts (vector-ref value 1)))
+                   (do ((index 0 (+ index 1))
+                        (total 0 (+ total (vector-ref counts index))))
+                       ((> index (vector-length bounds)))
+                     (display-sample
+                      (string-append name "_bucket")
+                      labels
+                      (string-append
+                       "le=\""
+                       (if (< index (vector-length bounds))
+                           (number->text (vector-ref bounds index))
+                           "+Inf")
+                       "\"")
+                      (+ total (vector-ref counts index))))
+                   (display-sample (string-append name "_sum")
+                                   labels #f (vector-ref value 2))
+                   (display-sample (string-append name "_count")
+                                   labels #f (vector-ref value 3))))
+                (else
+                 (display-sample name labels #f
+                                 (if (procedure? value) (value) value))))
+              (loop (cdr metrics) name)))))))
+
+
+
+;; Write the metrics to the named file, by way of a temporary file in the same
+;; directory which is then renamed over it, so that a reader never sees a file
+;; which is only partly written. Errors are ignored; the metrics are not worth
+;; stopping the daemon for.
+
+(define (write-metrics-file file-name)
+  (let ((temporary (string-append file-name ".tmp")))
+    (catch #t
+           (lambda ()
+             (with-output-to-file temporary
+               (lambda () (display (metrics-text))))
+             (rename-file temporary file-name))
+           (lambda (key . args)
+             (false-if-exception (delete-file temporary))))))
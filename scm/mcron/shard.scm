@@ -0,0 +1,225 @@
+;;   Copyright (C) 2026 Free Software Foundation, Inc.
+;;
+;;   This file is part of GNU mcron.
+;;
+;;   GNU mcron is free software: you can redistribute it and/or modify it under
+;;   the terms of the GNU General Public License as published by the Free
+;;   Software Foundation, either version 3 of the License, or (at your option)
+;;   any later version.
+;;
+;;   GNU mcron is distributed in the hope that it will be useful, but WITHOUT
+;;   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+;;   FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+;;   more details.
+;;
+;;   You should have received a copy of the GNU General Public License along
+;;   with GNU mcron.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+;; This module lets several cron daemons share one spool of crontabs, each of
+;; them running the jobs of only some of the users. The daemons are the members
+;; of a shard group, whose names all of them are given in the same list, and
+;; each member holds a lease on a file of its own, NAME.lease, in a directory
+;; which all of them can see (on a shared file system, when they are on
+;; different hosts). The lease is a lock on the file which the member takes
+;; when it starts, and which lapses when it dies; a member is live while its
+;; lease is held. We always count ourselves as live.
+;;
+;; The users are divided among the live members by consistent hashing: each
+;; member is placed at a number of points on a ring of 32-bit hash values, and
+;; a user belongs to the first live member at or after the hash of the user's
+;; name, going round the ring. When a member comes or goes, only the users on
+;; its part of the ring change hands, and all the members work out the same
+;; owners from the same list of live members.
+
+
+
+(define-module (mcron shard)
+  #:use-module (srfi srfi-1)
+  #:use-module (rnrs bytevectors)
+  #:export (set-shard!
+            take-shard-lease!
+            shard-member
+            live-shard-members
+            refresh-shard-members!
+            shard-owns?))
+
+
+
+;; Where the host provides them (see mcron.c), the leases are POSIX record
+;; locks, which are not handed down to the jobs the daemon forks. Otherwise we
+;; make do with flock.
+
+(define native-take-lease
+  (and=> (module-variable the-root-module 'c-take-lease) variable-ref))
+
+(define native-lease-held?
+  (and=> (module-variable the-root-module 'c-lease-held?) variable-ref))
+
+
+
+;; A hash of the string which is the same in every member, whatever the version
+;; of Guile: 32-bit FNV-1a over the UTF-8 bytes, with the final mixing step of
+;; MurmurHash3 so that names which differ only in their last character (as the
+;; points of one member do) are spread all round the ring.
+
+(define (shard-hash string)
+  (let ((bytes (string->utf8 string)))
+    (let loop ((index 0) (hash 2166136261))
+      (if (< index (bytevector-length bytes))
+          (loop (+ index 1)
+                (logand (* (logxor hash (bytevector-u8-ref bytes index))
+                           16777619)
+                        #xffffffff))
+          (let* ((hash (logxor hash (ash hash -16)))
+                 (hash (logand (* hash #x85ebca6b) #xffffffff))
+                 (hash (logxor hash (ash hash -13)))
+                 (hash (logand (* hash #xc2b2ae35) #xffffffff)))
+            (logxor hash (ash hash -16)))))))
+
+
+
+;; The ring is a vector of (hash . member) pairs in increasing order of hash,
+;; with shard-points entries for each member.
+
+(define shard-points 64)
+
+(define (make-shard-ring members)
+  (list->vector
+   (sort (append-map (lambda (member)
+                       (map (lambda (point)
+                              (cons (shard-hash (string-append
+                                                 member "#"
+                                                 (number->string point)))
+                                    member))
+                            (iota shard-points)))
+                     members)
+         (lambda (a b)
+           (or (< (car a) (car b))
+               (and (= (car a) (car b)) (string<? (cdr a) (cdr b))))))))
+
+
+;; The first live member at or after the hash, going round the ring.
+
+(define (ring-owner ring live hash)
+  (let* ((size (vector-length ring))
+         (start (let search ((low 0) (high size))
+                  (if (< low high)
+                      (let ((middle (quotient (+ low high) 2)))
+                        (if (< (car (vector-ref ring middle)) hash)
+                            (search (+ middle 1) high)
+                            (search low middle)))
+                      low))))
+    (let loop ((step 0))
+      (and (< step size)
+           (let ((candidate (cdr (vector-ref ring
+                                             (modulo (+ start step) size)))))
+             (if (member candidate live)
+                 candidate
+                 (loop (+ step 1))))))))
+
+
+
+;; The shard group we belong to, or #f if we are not sharding, is
+;;
+;;  (vector directory name members ring lease live)
+;;
+;; where lease is the port on our lease file when we hold it with flock (the
+;; native lease keeps its own file descriptor), and live the list of the
+;; members found to be live the last time we looked, in the order in which
+;; they were given.
+
+(define shard #f)
+
+(define (shard:directory) (vector-ref shard 0))
+(define (shard:name)      (vector-ref shard 1))
+(define (shard:members)   (vector-ref shard 2))
+(define (shard:ring)      (vector-ref shard 3))
+(define (shard:live)      (vector-ref shard 5))
+
+(define (lease-file member)
+  (string-append (shard:directory) "/" member ".lease"))
+
+
+(define (set-shard! directory members name)
+  (let ((members (delete-duplicates (remove string-null? members))))
+    (if (not (member name members))
+        (throw 'mcron-error 17
+               "shard: this member (" name ") is not in the list of members"))
+    (set! shard (vector directory name members (make-shard-ring members)
+                        #f (list name)))
+    (refresh-shard-members!)))
+
+
+(define (shard-member) (and shard (shard:name)))
+
+(define (live-shard-members) (if shard (shard:live) '()))
+
+
+
+;; Take our own lease, making the directory if there is none, trying the given
+;; number of times (once by default) a tenth of a second apart. A member which
+;; cannot get its lease must not start; there is already a member of that name.
+;; The daemon takes the lease again once it has forked, as the child does not
+;; inherit the lock from its parent, which will be letting go of it as it exits.
+
+(define (try-shard-lease)
+  (if native-take-lease
+      (native-take-lease (lease-file (shard:name)))
+      (or (vector-ref shard 4)
+          (let ((port (false-if-exception
+                       (open (lease-file (shard:name))
+                             (logior O_RDWR O_CREAT)
+                             #o644))))
+            (and port
+                 (if (false-if-exception
+                      (begin (flock port (logior LOCK_EX LOCK_NB)) #t))
+                     (begin (vector-set! shard 4 port) #t)
+                     (begin (close port) #f)))))))
+
+(define* (take-shard-lease! #:optional (tries 1))
+  (if (not (file-exists? (shard:directory)))
+      (false-if-exception (mkdir (shard:directory) #o755)))
+  (let loop ((tries tries))
+    (cond ((try-shard-lease))
+          ((> tries 1) (usleep 100000) (loop (- tries 1)))
+          (else
+           (throw 'mcron-error 1
+                  "Another member of the shard group is called "
+                  (shard:name) " (the lease " (lease-file (shard:name))
+                  " is held).")))))
+
+
+
+;; Find out which members are live now, and return the list of those which were
+;; before if it has changed (#f if not).
+
+(define (lease-held? member)
+  (if native-lease-held?
+      (native-lease-held? (lease-file member))
+      (let ((port (false-if-exception (open (lease-file member) O_RDONLY))))
+        (and port
+             (let ((free (false-if-exception
+                          (begin (flock port (logior LOCK_SH LOCK_NB)) #t))))
+               (close port)
+               (not free))))))
+
+(define (refresh-shard-members!)
+  (let ((live (filter (lambda (member)
+                        (or (string=? member (shard:name))
+                            (lease-held? member)))
+                      (shard:members)))
+        (previous (shard:live)))
+    (vector-set! shard 5 live)
+    (and (not (equal? live previous)) previous)))
+
+
+
+;; Whether the user of the given name is ours, given the list of live members
+;; (by default the ones we found last). When we are not sharding, everyone is.
+
+(define* (shard-owns? user-name #:optional (live (live-shard-members)))
+  (or (not shard)
+      (equal? (ring-owner (shard:ring) live (shard-hash user-name))
+              (shard:name))))
@@ -28,9 +28,14 @@
             parse-system-vixie-line
             read-vixie-port
             read-vixie-file
+            read-vixie-file-entries
+            read-vixie-files-entries
+            replay-vixie-entries
             check-system-crontab)
   #:use-module ((mcron config) :select (config-socket-file))
   #:use-module (mcron core)
+  #:use-module ((mcron environment) :select (get-current-environment-mod
+                                             restore-environment-mods))
   #:use-module (mcron job-specifier)
   #:use-module (mcron vixie-time))
 
@@ -47,16 +52,29 @@
 ;; job procedure run to add the two pieces of information to the job list (this
 ;; will in turn use the above function to turn the time specification into a
 ;; function for computing future run times of the command).
+;;
+;; The splitting is done separately from adding the job, so that the pieces can
+;; be kept in the start-up cache (see read-vixie-file-entries below). A split
+;; line is the list (time-spec user command), where the user is #f except in
+;; /etc/crontab.
 
 (define parse-user-vixie-line-regexp
   (make-regexp "^[[:space:]]*(([^[:space:]]+[[:space:]]+){5})(.*)$"))
 
-(define (parse-user-vixie-line line)
+(define (split-user-vixie-line line)
   (let ((match (regexp-exec parse-user-vixie-line-regexp line)))
     (if (not match) 
         (throw 'mcron-error 10 "Bad job line in Vixie file."))
-    (job (match:substring match 1)
-         (match:substring match 3))))
+    (list (match:substring match 1)
+          #f
+          (match:substring match 3))))
+
+(define (add-vixie-job time-spec user command)
+  (if user (set-configuration-user user))
+  (job time-spec command))
+
+(define (parse-user-vixie-line line)
+  (apply add-vixie-job (split-user-vixie-line line)))
 
 
 
@@ -67,14 +85,16 @@
   (make-regexp (string-append "^[[:space:]]*(([^[:space:]]+[[:space:]]+){5})"
                               "([[:alpha:]][[:alnum:]_]*)[[:space:]]+(.*)$")))
 
-(define (parse-system-vixie-line line)
+(define (split-system-vixie-line line)
   (let ((match (regexp-exec parse-system-vixie-line-regexp line)))
     (if (not match) 
         (throw 'mcron-error 11 "Bad job line in /etc/crontab."))
-    (let ((user (match:substring match 3)))
-      (set-configuration-user user)
-      (job (match:substring match 1)
-           (match:substring match 4)))))
+    (list (match:substring match 1)
+          (match:substring match 3)
+          (match:substring match 4))))
+
+(define (parse-system-vixie-line line)
+  (apply add-vixie-job (split-system-vixie-line line)))
 
 
 
@@ -110,6 +130,52 @@
 
 
 
+;; The limits on the numbers of jobs the daemon will run at once can be set in
+;; /etc/crontab, with the MCRON_MAX_JOBS and MCRON_MAX_USER_JOBS settings. They
+;; are reset every time the file is read, so taking a setting out of the file
+;; removes the limit.
+
+(define* (system-job-limit name #:optional (minimum 1))
+  (and-let* ((value (get-current-environment-mod name)))
+            (let ((limit (string->number value)))
+              (if (and limit (integer? limit) (exact? limit) (>= limit minimum))
+                  limit
+                  (throw 'mcron-error 17 "Invalid " name " setting.")))))
+
+(define (set-system-job-limits)
+  (set-job-limits! #:total (system-job-limit "MCRON_MAX_JOBS")
+                   #:per-user (system-job-limit "MCRON_MAX_USER_JOBS")))
+
+
+;; Likewise, the handling of the jobs' output (see the core module) is set with
+;; MCRON_LOG_DIR (where the logs go; there are none if this is not set),
+;; MCRON_LOG_SIZE and MCRON_LOG_FILES (when the logs are rotated, and how many
+;; old ones are kept), MCRON_OUTPUT_BUFFER (how much of each job's output is
+;; mailed), MCRON_MAIL_INTERVAL (how often the mail goes) and MCRON_SENDMAIL
+;; (the command which sends it).
+
+(define (system-setting key value)
+  (if value (list key value) '()))
+
+(define (set-system-job-output)
+  (apply set-job-output!
+         (append (system-setting #:log-directory
+                                 (get-current-environment-mod "MCRON_LOG_DIR"))
+                 (system-setting #:log-size
+                                 (system-job-limit "MCRON_LOG_SIZE"))
+                 (system-setting #:log-files
+                                 (system-job-limit "MCRON_LOG_FILES" 0))
+                 (system-setting #:buffer-size
+                                 (system-job-limit "MCRON_OUTPUT_BUFFER"))
+                 (system-setting #:mail-interval
+                                 (system-job-limit "MCRON_MAIL_INTERVAL"))
+                 (system-setting #:sendmail
+                                 (get-current-environment-mod
+                                  "MCRON_SENDMAIL")))))
+
+
+
+
 ;; The next procedure reads an entire Vixie-style file. For each line in the
 ;; file there are three possibilities (after continuation lines have been
 ;; appended): the line is blank or contains only a comment, the line contains an
@@ -126,45 +192,67 @@
   (make-regexp "^[[:space:]]*(#.*)?$"))
 
 
+;; Errors found while dealing with a line are reported with its line number.
+
+(define (with-line-number line-number thunk)
+  (catch 'mcron-error
+         thunk
+         (lambda (key exit-code . msg)
+           (throw
+            'mcron-error
+            exit-code
+            (apply string-append
+                   (number->string line-number)
+                   ": "
+                   msg)))))
+
+
+
+;; Call the procedure with each logical line of the port and its line number
+;; (if the line ends with \, the next line is appended to it).
+
+(define (for-each-vixie-line port procedure)
+  (do ((line (read-line port) (read-line port))
+       (line-number 1 (1+ line-number)))
+      ((eof-object? line))
+
+    (let ((report-line line-number))
+      ;; If the line ends with \, append the next line.
+      (while (and (>= (string-length line) 1)
+                  (char=? (string-ref line
+                                      (- (string-length line) 1))
+                          #\\))
+             (let ((next-line (read-line port)))
+               (if (eof-object? next-line)
+                   (set! next-line ""))
+               (set! line-number (1+ line-number))
+               (set! line
+                     (string-append
+                      (substring line 0 (- (string-length line) 1))
+                      next-line))))
+
+      (with-line-number report-line
+                        (lambda () (procedure line report-line))))))
+
+
+
 (define (read-vixie-port port . parse-vixie-line)
   (clear-environment-mods)
   (if port
       (let ((parse-vixie-line
              (if (null? parse-vixie-line) parse-user-vixie-line
                  (car parse-vixie-line))))
-        (do ((line (read-line port) (read-line port))
-             (line-number 1 (1+ line-number)))
-            ((eof-object? line))
-
-          (let ((report-line line-number))
-            ;; If the line ends with \, append the next line.
-            (while (and (>= (string-length line) 1)
-                        (char=? (string-ref line
-                                            (- (string-length line) 1))
-                                #\\))
-                   (let ((next-line (read-line port)))
-                     (if (eof-object? next-line)
-                         (set! next-line ""))
-                     (set! line-number (1+ line-number))
-                     (set! line
-                           (string-append
-                            (substring line 0 (- (string-length line) 1))
-                            next-line))))
-
-            (catch 'mcron-error
-                   (lambda ()
-                     ;; Consider the three cases mentioned in the description.
-                     (or (regexp-exec read-vixie-file-comment-regexp line)
-                         (parse-vixie-environment line)
-                         (parse-vixie-line line)))
-                   (lambda (key exit-code . msg)
-                     (throw
-                      'mcron-error
-                      exit-code
-                      (apply string-append
-                             (number->string report-line)
-                             ": "
-                             msg)))))))))
+        (for-each-vixie-line
+         port
+         (lambda (line line-number)
+           ;; Consider the three cases mentioned in the description.
+           (or (regexp-exec read-vixie-file-comment-regexp line)
+               (parse-vixie-environment line)
+               (parse-vixie-line line))))
+        (if (eq? parse-vixie-line parse-system-vixie-line)
+            (begin
+              (set-system-job-limits)
+              (set-system-job-output))))))
 
 
 
@@ -189,17 +277,87 @@
                         (apply string-append file-path ":" msg)))))))
 
 
-;; A procedure which determines if the /etc/crontab file has been recently
-;; modified, and, if so, signals the main routine to re-read the file. We run
-;; under the with-mail-to command so that the process runs as a child,
-;; preventing lockup. If cron is supposed to check for updates to /etc/crontab,
-;; then this procedure will be called about 5 seconds before every minute.
-
-(define (check-system-crontab)
-  (lambda ()
-    (let ((mtime (stat:mtime (stat "/etc/crontab"))))
-      (if (> mtime (- (current-time) 60))
-          (let ((socket (socket AF_UNIX SOCK_STREAM 0)))
-            (connect socket AF_UNIX config-socket-file)
-            (display "/etc/crontab" socket)
-            (close socket))))))
+
+;; For the start-up cache, a crontab can instead be read into a list of
+;; entries, each of which holds everything needed to add one job:
+;;
+;;  (line-number time-spec user command environment)
+;;
+;; where the user and command are as split from the line above, and the
+;; environment is the set of environment modifications in force at the line.
+;; Replaying the entries adds exactly the jobs that reading the file would have
+;; done.
+;;
+;; Many files can be read at once with read-vixie-files-entries, which gives a
+;; list with an element for each file: the file's entries, or #f if it cannot
+;; be opened (as with read-vixie-file), or a vector of the exit code and message
+;; of the error found in it. Where the host provides it (see mcron.c), the
+;; files are parsed natively on several threads at once; otherwise (or if the
+;; native parser runs out of memory) we do it here, one after the other.
+
+(define native-parse-crontab-files
+  (and=> (module-variable the-root-module 'c-parse-crontab-files) variable-ref))
+
+(define (scheme-vixie-file-entries file-path system?)
+  (let ((split-line (if system? split-system-vixie-line split-user-vixie-line))
+        (port (false-if-exception (open-input-file file-path)))
+        (entries '()))
+    (and port
+         (catch 'mcron-error
+                (lambda ()
+                  (clear-environment-mods)
+                  (for-each-vixie-line
+                   port
+                   (lambda (line line-number)
+                     (or (regexp-exec read-vixie-file-comment-regexp line)
+                         (parse-vixie-environment line)
+                         (set! entries
+                               (cons (cons line-number
+                                           (append
+                                            (split-line line)
+                                            (list
+                                             (get-current-environment-mods-copy))))
+                                     entries)))))
+                  (close port)
+                  (reverse! entries))
+                (lambda (key exit-code . msg)
+                  (close port)
+                  (vector exit-code (apply string-append msg)))))))
+
+(define (read-vixie-files-entries file-paths . system?)
+  (let ((system? (and (pair? system?) (car system?))))
+    (or (and native-parse-crontab-files
+             (native-parse-crontab-files file-paths system?))
+        (map (lambda (file-path) (scheme-vixie-file-entries file-path system?))
+             file-paths))))
+
+(define (read-vixie-file-entries file-path . system?)
+  (let ((entries (car (apply read-vixie-files-entries (list file-path) system?))))
+    (if (vector? entries)
+        (throw 'mcron-error (vector-ref entries 0)
+               (string-append file-path ":" (vector-ref entries 1)))
+        entries)))
+
+
+
+;; Add the jobs in the entries read from the file. If an error was found in the
+;; file, it is thrown now.
+
+(define (replay-vixie-entries file-path entries)
+  (if (vector? entries)
+      (throw 'mcron-error (vector-ref entries 0)
+             (string-append file-path ":" (vector-ref entries 1))))
+  (catch 'mcron-error
+         (lambda ()
+           (for-each (lambda (entry)
+                       (with-line-number
+                        (car entry)
+                        (lambda ()
+                          (restore-environment-mods (list-ref entry 4))
+                          (add-vixie-job (list-ref entry 1)
+                                         (list-ref entry 2)
+                                         (list-ref entry 3)))))
+                     entries))
+         (lambda (key exit-code . msg)
+           (throw 'mcron-error exit-code
+                  (apply string-append file-path ":" msg)))))
@@ -17,7 +17,9 @@
 
 
 (define-module (mcron vixie-time)
-  #:export (parse-vixie-time)
+  #:export (parse-vixie-time
+            valid-timezone?
+            call-with-timezone)
   #:use-module (mcron job-specifier))
 
 
@@ -264,6 +266,59 @@
 
 
 
+;; When we are running inside the mcron program, the C wrapper provides a native
+;; version of the next-time computation which works on bitmasks rather than
+;; lists (see mcron.c.template). When this module is loaded into some other
+;; Guile program it will not be there, and we just use the Scheme procedures
+;; above.
+
+(define native-compile-vixie-time
+  (and=> (module-variable the-root-module 'c-compile-vixie-time) variable-ref))
+
+(define native-vixie-spec-next-time
+  (and=> (module-variable the-root-module 'c-vixie-spec-next-time)
+         variable-ref))
+
+(define native-load-timezone
+  (and=> (module-variable the-root-module 'c-load-timezone) variable-ref))
+
+
+
+;; A time specification may be given a time zone other than the host's (with
+;; CRON_TZ in a crontab), named as the TZ environment variable would name it:
+;; the name of a file in the zoneinfo directory, such as Europe/Paris, or a
+;; POSIX rule, such as EST5EDT,M3.2.0,M11.1.0. As the names can come from any
+;; user's crontab, absolute file names and names with .. in them are not
+;; allowed. The native code loads each zone once and does all the conversions
+;; itself (see mcron.c.template); otherwise we have to set TZ around the
+;; computations, which is slow but gives the same results.
+
+(define (valid-timezone? name)
+  (and (string? name)
+       (not (string-prefix? "/" (string-trim name #\:)))
+       (not (string-contains name ".."))
+       (or (not native-load-timezone)
+           (native-load-timezone name))))
+
+(define (call-with-timezone timezone thunk)
+  (let ((host-timezone (getenv "TZ")))
+    (dynamic-wind (lambda () (setenv "TZ" timezone) (tzset))
+                  thunk
+                  (lambda () (setenv "TZ" host-timezone) (tzset)))))
+
+
+
+;; Turn a list of the acceptable values of a time component into an integer with
+;; the corresponding bits set. If any of the values lies outside the range
+;; [0, limit), the specification cannot be represented as a bitmask and #f is
+;; returned.
+
+(define (time-list->bitmask time-list limit)
+  (and (every (lambda (value) (and (>= value 0) (< value limit))) time-list)
+       (fold (lambda (value mask) (logior mask (ash 1 value))) 0 time-list)))
+
+
+
 ;; This is a procedure which returns a procedure which computes the next time a
 ;; command should run after the current time, based on the information in the
 ;; Vixie-style time specification.
@@ -302,9 +357,28 @@
 ;;   through the higher components if necessary [6]. We now have the next time
 ;;   the command needs to run.
 ;;
-;;   The new time is then converted back into a UNIX time and returned [7].
+;;   The new time is then converted back into a UNIX time and returned [7],
+;;   letting mktime work out whether summer time is in force then (so that the
+;;   time is right even if the clocks change before it).
+;;
+;; Finally, if the native computation is available and the lists can all be
+;; compiled into bitmasks [8], the C code compiles the masks into a record of
+;; its own, and we return a procedure which hands the record's index to the C
+;; code instead [9]. This yields identical results (and if the C code
+;; finds the specification can never be satisfied it hands the job back to the
+;; Scheme procedure), but is very much faster. The C code also settles exactly
+;; what happens to the times which the changes of the clocks skip or repeat: a
+;; time which is skipped is taken to be the moment the clocks go forward, and
+;; of a time which happens twice the first after the current time is taken.
+;;
+;; If a timezone is given, the times are local times in that zone rather than
+;; the host's [10].
+;;
+;; Either way, the procedure already allows for the changes of the clocks, and
+;; is marked as doing so with the dst-adjusted property, so that the job
+;; procedure does not try to do this again [11].
 
-(define (parse-vixie-time string)
+(define* (parse-vixie-time string #:optional (timezone #f))
   (let ((tokens (string-tokenize (vixie-substitute-parse-symbols string))))
     (cond
      ((> (length tokens) 5)
@@ -354,32 +428,65 @@
                            (vector-ref (caddr time-spec-list) 0)))  ;; [2.1]
 
 
-      (lambda (current-time)     ;; [3]
-        (let ((time (localtime current-time)))  ;; [4]
-
-          (if (not (member (tm:mon time)
-                           (time-spec:list (cadddr time-spec-list))))
-              (begin
-                (nudge-month! time (cdddr time-spec-list))
-                (set-tm:mday  time 0)))
-          (if (or (eqv? (tm:mday time) 0)
-                  (not (member (tm:mday time)
-                               (interpolate-weekdays
-                                (time-spec:list (caddr time-spec-list))
-                                (time-spec:list (caddr (cddr time-spec-list)))
-                                (tm:mon time)
-                                (tm:year time)))))
-              (begin
-                (nudge-day! time (cddr time-spec-list))
-                (set-tm:hour time -1)))
-          (if (not (member (tm:hour time)
-                           (time-spec:list (cadr time-spec-list))))
-              (begin
-                (nudge-hour! time (cdr time-spec-list))
-                (set-tm:min time -1)))   ;; [5]
-
-          (set-tm:sec time 0)
-          (nudge-min! time time-spec-list)  ;; [6]
-          (car (mktime time))))))) ;; [7]
+      (let* ((scheme-next-time
+              (lambda (current-time)     ;; [3]
+                (let ((time (localtime current-time)))  ;; [4]
+
+                  (if (not (member (tm:mon time)
+                                   (time-spec:list (cadddr time-spec-list))))
+                      (begin
+                        (nudge-month! time (cdddr time-spec-list))
+                        (set-tm:mday  time 0)))
+                  (if (or (eqv? (tm:mday time) 0)
+                          (not (member (tm:mday time)
+                                       (interpolate-weekdays
+                                        (time-spec:list (caddr time-spec-list))
+                                        (time-spec:list
+                                         (caddr (cddr time-spec-list)))
+                                        (tm:mon time)
+                                        (tm:year time)))))
+                      (begin
+                        (nudge-day! time (cddr time-spec-list))
+                        (set-tm:hour time -1)))
+                  (if (not (member (tm:hour time)
+                                   (time-spec:list (cadr time-spec-list))))
+                      (begin
+                        (nudge-hour! time (cdr time-spec-list))
+                        (set-tm:min time -1)))   ;; [5]
+
+                  (set-tm:sec time 0)
+                  (nudge-min! time time-spec-list)  ;; [6]
+                  (set-tm:isdst time -1)
+                  (car (mktime time)))))  ;; [7]
+
+             (bitmasks
+              (and native-compile-vixie-time
+                   (map (lambda (time-spec limit)
+                          (time-list->bitmask (time-spec:list time-spec)
+                                              limit))
+                        time-spec-list
+                        '(60 24 32 13 7))))  ;; [8]
+
+             (compiled
+              (and bitmasks
+                   (every identity bitmasks)
+                   (apply native-compile-vixie-time
+                          (append bitmasks (list timezone))))))
+
+        (let* ((scheme-next-time
+                (if timezone
+                    (lambda (current-time)  ;; [10]
+                      (call-with-timezone timezone
+                                          (lambda ()
+                                            (scheme-next-time current-time))))
+                    scheme-next-time))
+               (next-time-proc
+                (if compiled
+                    (lambda (current-time)  ;; [9]
+                      (or (native-vixie-spec-next-time compiled current-time)
+                          (scheme-next-time current-time)))
+                    scheme-next-time)))
+          (set-procedure-property! next-time-proc 'dst-adjusted #t)  ;; [11]
+          next-time-proc)))))
 
 